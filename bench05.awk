@@ -0,0 +1,15 @@
+# Emit N command lines for tsh, one command each, with a probe of the
+# shell's resident set size after every tenth of them
+BEGIN {
+    print "f() { echo $1 $# > /dev/null; }"
+    for (i = 1; i <= N; i++) {
+        k = i % 5
+        if (k == 0) print "x=$((x + 1))"
+        else if (k == 1) print "echo $x $(echo y $(echo z)) > /dev/null"
+        else if (k == 2) print "if test $x -gt 0; then : a b c; else : d; fi"
+        else if (k == 3) print "f $x two three"
+        else print "for w in a b $x; do s=$w; done"
+        if (i % (N / 10) == 0)
+            print "/bin/sh -c 'echo bench05: $0 commands, $(grep VmRSS /proc/$PPID/status)' " i
+    }
+}
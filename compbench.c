@@ -0,0 +1,141 @@
+/*
+ * compbench - Time Tab completion of command names on a synthetic PATH
+ *    of 50k executables in 20 directories: building the index once,
+ *    each completion from it, the same completion done by reading the
+ *    PATH directories again, and how soon a new or removed executable
+ *    shows. Built from tsh.c itself, with the shell's main renamed.
+ */
+#define main tsh_main
+#include "tsh.c"
+#undef main
+
+#define DIRS     20
+#define PERDIR   2500
+#define ROUNDS   100000
+#define RESCANS  20
+
+char root[] = "/tmp/compbench.XXXXXX";
+char names[DIRS][PERDIR][12];
+long long lat[ROUNDS];
+
+long long nsnow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int llcmp(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/* prefix - A prefix of 1 to 3 letters, as typed before a Tab */
+int prefix(char *s) {
+    int n = 1 + random() % 3;
+
+    for (int i = 0; i < n; i++)
+        s[i] = 'a' + random() % 26;
+    return n;
+}
+
+/* rescan - Complete s[0..len) by reading every PATH directory */
+int rescan(const char *s, int len) {
+    int found = 0;
+
+    for (int d = 0; d < cmdidx.ndirs; d++) {
+        DIR *dp = opendir(cmdidx.dir[d]);
+        struct dirent *de;
+        struct stat st;
+
+        while ((de = readdir(dp)) != NULL)
+            if (strncmp(de->d_name, s, len) == 0
+                    && fstatat(dirfd(dp), de->d_name, &st, 0) == 0
+                    && S_ISREG(st.st_mode) && (st.st_mode & 0111))
+                found++;
+        closedir(dp);
+    }
+    return found;
+}
+
+/* until - Apply PATH changes until the index has name, or lacks it */
+void until(const char *name, int present) {
+    do
+        pathsync();
+    while (onpath(name) != present);
+}
+
+int main(void) {
+    char path[DIRS * 32], file[64], s[4];
+    int lo, lcp, len, fd, missing = 0;
+    long long start, sum = 0, ns, made, gone;
+
+    if (mkdtemp(root) == NULL)
+        unix_error("mkdtemp error");
+    path[0] = '\0';
+    srandom(1);
+    for (int d = 0; d < DIRS; d++) {
+        sprintf(file, "%s/bin%02d", root, d);
+        mkdir(file, 0755);
+        sprintf(path + strlen(path), "%s%s", d ? ":" : "", file);
+        for (int i = 0; i < PERDIR; i++) {
+            int n = 4 + random() % 7;
+            for (int k = 0; k < n; k++)
+                names[d][i][k] = 'a' + random() % 26;
+            sprintf(names[d][i] + n, "%d", i % 10); /* few clash */
+            sprintf(file, "%s/bin%02d/%s", root, d, names[d][i]);
+            if ((fd = open(file, O_WRONLY | O_CREAT, 0755)) >= 0)
+                close(fd);
+        }
+    }
+    setenv("PATH", path, 1);
+
+    start = nsnow();
+    pathindex();
+    printf("bench07: indexed %d executables in %d PATH directories in %lld ms\n",
+           cmdidx.n, cmdidx.ndirs, (nsnow() - start) / 1000000);
+    for (int d = 0; d < DIRS; d++)
+        for (int i = 0; i < PERDIR; i++)
+            missing += !onpath(names[d][i]);
+
+    for (int i = 0; i < ROUNDS; i++) {
+        len = prefix(s);
+        start = nsnow();
+        cmdcomplete(s, len, &lo, &lcp);
+        sum += lat[i] = nsnow() - start;
+    }
+    qsort(lat, ROUNDS, sizeof(long long), llcmp);
+    printf("bench07: completion from the index: %lld ns mean, %lld ns p99, over %d prefixes\n",
+           sum / ROUNDS, lat[ROUNDS * 99 / 100], ROUNDS);
+
+    start = nsnow();
+    for (int i = 0; i < RESCANS; i++) {
+        len = prefix(s);
+        rescan(s, len);
+    }
+    ns = (nsnow() - start) / RESCANS;
+    printf("bench07: completion by reading PATH again: %lld us mean\n", ns / 1000);
+
+    sprintf(file, "%s/bin07/zzzcompbench", root);
+    start = nsnow();
+    close(open(file, O_WRONLY | O_CREAT, 0755));
+    until("zzzcompbench", 1);
+    made = nsnow() - start;
+    start = nsnow();
+    unlink(file);
+    until("zzzcompbench", 0);
+    gone = nsnow() - start;
+    printf("bench07: new executable completes after %lld us, removed one after %lld us\n",
+           made / 1000, gone / 1000);
+
+    for (int d = 0; d < DIRS; d++) {
+        for (int i = 0; i < PERDIR; i++) {
+            sprintf(file, "%s/bin%02d/%s", root, d, names[d][i]);
+            unlink(file);
+        }
+        sprintf(file, "%s/bin%02d", root, d);
+        rmdir(file);
+    }
+    rmdir(root);
+    return missing != 0;
+}
@@ -2,6 +2,7 @@
  * tsh - A tiny shell program with job control
  * 
  */
+#define _GNU_SOURCE         /* memfd_create, splice, fopencookie, F_SETPIPE_SZ */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -10,13 +11,36 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <stddef.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <setjmp.h>
+#include <termios.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
 
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
 #define MAXARGS     128   /* max args on a command line */
 #define MAXJOBS      16   /* max jobs at any point in time */
+#define VARHASH     256   /* buckets in the variable and function tables */
+#define MAXPROCS     64   /* max processes (pipeline stages) in one job */
+#define MAXFANOUT    64   /* max copies of a |&N pipeline stage */
+#define FANOUT_CHUNK (8 << 20) /* bytes of input per copy of a |&N stage */
+#define TW_BITS       6   /* the timer wheel has 64 slots per level, */
+#define TW_LEVELS     6   /* 1 ms apart on level 0: about 795 days in all */
+#define KILLGRACE  2000   /* ms from SIGTERM to SIGKILL for a timed out job */
+#define ARENA_SIZE (4 << 20) /* ceiling on one command's parse and launch data */
+#define SPILL_MIN (64 << 10) /* compiled literals this big go to the heap */
+#define MAXPATHDIRS  64   /* PATH directories indexed for completion */
+#define LISTMAX     100   /* completions listed at most */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -40,23 +64,220 @@ char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
 
+struct wtimer_t {           /* Entry of the deadline timer wheel */
+    struct wtimer_t *next;  /* next entry in the same slot */
+    struct wtimer_t **pprev; /* link pointing at it, NULL if not armed */
+    unsigned long long expires; /* CLOCK_MONOTONIC ms */
+    int level, slot;        /* where it is queued */
+    void (*fire)(struct wtimer_t *); /* called once it expires */
+};
+
+struct wheel_t {            /* Hierarchical timer wheel of all deadlines */
+    struct wtimer_t *slots[TW_LEVELS][1 << TW_BITS];
+    unsigned long long occupied[TW_LEVELS]; /* bit per non-empty slot */
+    unsigned long long now; /* ms the wheel has been run up to */
+    unsigned long long armedfor; /* ms the timerfd is set for, or ~0 */
+    int count;              /* armed timers */
+    int fd;                 /* timerfd, -1 until the first deadline */
+};
+struct wheel_t wheel = {.fd = -1}; /* The deadline timer wheel */
+
+struct spill_t {            /* Heap block freed along with the arena */
+    struct spill_t *next;   /* the one spilled before it */
+    size_t at;              /* arena offset it was spilled at */
+};
+
+struct arena_t {            /* Bump allocator for the current command */
+    char *base;             /* ARENA_SIZE bytes, mapped on first use */
+    size_t used;            /* bytes handed out */
+    size_t high;            /* most ever in use at once */
+    int persist;            /* > 0 while compiling a function body */
+    jmp_buf *full;          /* where compile goes if the arena runs out */
+    struct spill_t *spill;  /* heap blocks, newest first */
+};
+struct arena_t arena;       /* The per-command arena */
+
+struct cmdent_t {           /* Executable on PATH, for completion */
+    char *name;
+    unsigned long long dirs; /* bit per PATH directory that has it */
+};
+
+struct cmdindex_t {         /* Sorted index of the executables on PATH */
+    struct cmdent_t *ent;   /* sorted by name, one per name */
+    int n, cap;
+    char *dir[MAXPATHDIRS]; /* the PATH directories */
+    int wd[MAXPATHDIRS];    /* inotify watch of each, -1 if none */
+    int ndirs;
+    int built;              /* set once the index is built */
+    int fd;                 /* inotify descriptor, -1 if none */
+};
+struct cmdindex_t cmdidx = {.fd = -1}; /* The command index */
+
+struct stage_t {            /* One stage of a pipeline being launched */
+    char **argv;            /* its words, in the command's argv */
+    int argc;               /* the slot after them, NULLed in the child */
+    int copies;             /* copies after |&N, else 0 */
+    int ordered;            /* keep the output of the copies in order */
+};
+
 struct job_t {              /* Per-job data */
-    pid_t pid;              /* job PID */
+    pid_t pid;              /* job PID, also its process group */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, FG, BG, or ST */
+    int nprocs;             /* processes of the job still running */
+    pid_t procs[MAXPROCS];  /* their PIDs, one per pipeline stage */
+    pid_t lastpid;          /* last stage, whose status is the job's */
+    struct wtimer_t deadline; /* armed while the job has a deadline */
+    int timedout;           /* 1 once sent SIGTERM on expiry, 2 SIGKILL */
+    int *exitp;             /* where to leave its exit status, or NULL */
     char cmdline[MAXLINE];  /* command line */
 };
 struct job_t jobs[MAXJOBS]; /* The job list */
 
 volatile sig_atomic_t ready; /* Is the newest child in its own process group? */
 
+/* Node types of a compiled script */
+#define N_CMD   0 /* simple command or pipeline */
+#define N_IF    1 /* if/elif/else */
+#define N_WHILE 2 /* while loop */
+#define N_UNTIL 3 /* until loop */
+#define N_FOR   4 /* for loop */
+#define N_FUNC  5 /* function definition */
+#define N_GROUP 6 /* { list } */
+#define N_AND   7 /* cond && body */
+#define N_OR    8 /* cond || body */
+
+/* Word segment types */
+#define S_LIT    0 /* literal text */
+#define S_VAR    1 /* $name or ${name} */
+#define S_ARG    2 /* $0 .. $9 */
+#define S_NARGS  3 /* $# */
+#define S_STATUS 4 /* $? */
+#define S_ARITH  5 /* $((expr)) */
+#define S_ALL    6 /* $@ */
+#define S_CMDSUB 7 /* $(list) */
+
+/* Postfix ops of a compiled $((expr)) */
+#define A_NUM   0  /* push constant */
+#define A_VAR   1  /* push variable */
+#define A_ARG   2  /* push positional parameter */
+#define A_NEG   3
+#define A_NOT   4
+#define A_MUL   5
+#define A_DIV   6
+#define A_MOD   7
+#define A_ADD   8
+#define A_SUB   9
+#define A_LT   10
+#define A_LE   11
+#define A_GT   12
+#define A_GE   13
+#define A_EQ   14
+#define A_NE   15
+#define A_AND  16
+#define A_OR   17
+
+/* Pending loop/function control */
+#define L_BREAK    1
+#define L_CONTINUE 2
+#define L_RETURN   3
+
+struct var_t {              /* Shell variable */
+    char *name;             /* variable name */
+    char *value;            /* current value, NULL if unset */
+    size_t cap;             /* bytes allocated for value */
+    struct var_t *next;     /* hash chain */
+};
+struct var_t *vars[VARHASH]; /* The variable table */
+
+struct aop_t {              /* One postfix op of a compiled $((expr)) */
+    int op;                 /* A_NUM, A_VAR, A_ADD, ... */
+    long num;               /* constant, or positional index for A_ARG */
+    struct var_t *var;      /* variable for A_VAR */
+};
+
+struct seg_t {              /* Piece of a compiled word */
+    int type;               /* S_LIT, S_VAR, ... */
+    char *lit;              /* literal text for S_LIT */
+    int len;                /* length of lit */
+    struct var_t *var;      /* variable for S_VAR */
+    int arg;                /* index for S_ARG */
+    struct aop_t *ops;      /* postfix program for S_ARITH */
+    int nops;
+    struct node_t *prog;    /* compiled list for S_CMDSUB */
+    int inproc;             /* S_CMDSUB runs only builtins, so no fork */
+    int fgen;               /* funcgen when inproc was decided */
+};
+
+struct word_t {             /* Compiled command word */
+    char *lit;              /* whole word when nothing needs expanding */
+    struct var_t *assign;   /* target of a leading NAME=value word */
+    struct seg_t *segs;     /* segments to expand, NULL if literal */
+    int nsegs;
+    int split;              /* has $(...): split the result into fields */
+};
+
+struct args_t {             /* Expanded words of a command */
+    char **v;               /* argv, NULL-terminated */
+    int n, cap;
+    char **own;             /* Malloc'd strings to free afterwards */
+    int nown, owncap;
+    char *vbuf[MAXARGS];    /* initial storage for v */
+    char *ownbuf[MAXARGS];  /* initial storage for own */
+};
+
+struct str_t {              /* String being built by expansion */
+    char *s;
+    size_t len, cap;
+    int heap;               /* outgrew the arena and was Malloc'd */
+};
+
+struct node_t {             /* Compiled command */
+    int type;               /* N_CMD, N_IF, ... */
+    struct node_t *next;    /* next command in the list */
+    struct node_t *cond;    /* if/while condition, left of && or || */
+    struct node_t *body;    /* then-branch, loop, group or function body,
+                               right of && or || */
+    struct node_t *alt;     /* else/elif branch */
+    struct word_t *words;   /* command words, or the for-loop list */
+    int nwords;
+    struct var_t *var;      /* for-loop variable */
+    char *text;             /* command line for the job list, function name */
+};
+
+struct func_t {             /* Shell function */
+    char *name;
+    struct node_t *body;
+    struct func_t *next;    /* hash chain */
+};
+struct func_t *funcs[VARHASH]; /* The function table */
+int funcgen;                /* bumped each time a new function name appears */
+
+int status;                 /* exit status of the last command ($?) */
+int substatus;              /* exit status of the last $(...), -1 if none */
+FILE *shellout;             /* the shell's own stdout, while $(...) swaps it */
+FILE *capout;               /* stdout of a $(...) run in the shell */
+struct str_t capbuf = {.heap = 1}; /* what capout has been sent, reused */
+char heredoc[MAXLINE];      /* delimiter line of an unfinished here-document */
+volatile sig_atomic_t fgstatus; /* exit status of the last foreground child */
+volatile sig_atomic_t intr; /* ctrl-c arrived while a script was running */
+int loopctl;                /* pending break, continue or return */
+int loopdepth;              /* number of enclosing loops */
+int funcdepth;              /* number of enclosing function calls */
+char **posv;                /* positional parameters: $0, $1, ... */
+int posc;                   /* number of positional parameters ($#) */
+long timeoutms;             /* deadline for the next job, from timeout */
+int nojobctl;               /* a dag task: jobs stay in its process group */
+
 /* End global variables */
 
 
 /* Function prototypes */
 
 /* Here are the functions that you will implement */
-void eval(char *cmdline);
+int eval(char *cmdline);
+int runcmd(char **argv, int argc, char *cmdline);
+int ioredirection(char **argv);
 int builtin_cmd(char **argv);
 void do_bgfg(char **argv);
 void waitfg(pid_t pid);
@@ -73,18 +294,70 @@ void clearjob(struct job_t *job);
 void initjobs(struct job_t *jobs);
 int freejid(struct job_t *jobs); 
 int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
+void addproc(struct job_t *job, pid_t pid);
 int deletejob(struct job_t *jobs, pid_t pid); 
+void deleteproc(struct job_t *jobs, pid_t pid);
+void signaljob(struct job_t *job, int sig);
 pid_t fgpid(struct job_t *jobs);
 struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
+struct job_t *getjobproc(struct job_t *jobs, pid_t pid);
 struct job_t *getjobjid(struct job_t *jobs, int jid); 
 int pid2jid(pid_t pid); 
 void listjobs(struct job_t *jobs);
 
+/* Deadline timer wheel */
+void twarm(struct wtimer_t *t, long ms);
+void twcancel(struct wtimer_t *t);
+void twexpire(void);
+void twreset(void);
+void twwait(sigset_t *mask);
+long twleft(struct wtimer_t *t);
+long parseduration(const char *s);
+void jobexpired(struct wtimer_t *t);
+
+/* Per-command arena */
+void *aalloc(size_t n);
+void *agrow(void *p, size_t old, size_t n);
+void *aspill(size_t n);
+size_t amark(void);
+void arelease(size_t mark);
+int inarena(const void *p);
+
+/* Script compiler and interpreter */
+struct var_t *lookupvar(const char *name, int len);
+void setvar(struct var_t *v, const char *value);
+struct func_t *findfunc(const char *name);
+void definefunc(const char *name, struct node_t *body);
+int compile(const char *text, struct node_t **progp);
+void freenode(struct node_t *n);
+void dropfuncs(struct node_t *n);
+char *expandword(struct word_t *w, int *heap);
+void cmdsub(struct seg_t *g, struct str_t *b);
+int execlist(struct node_t *n);
+int execnode(struct node_t *n);
+int execcmd(struct node_t *n);
+int isbuiltin(const char *name);
+int do_echo(char **argv);
+int do_test(char **argv);
+int do_deadline(char **argv);
+int do_dag(char **argv);
+
+/* Line editor */
+char *editline(const char *prompt, char *buf, int size);
+void pathindex(void);
+void pathsync(void);
+int cmdcomplete(const char *s, int len, int *lo, int *lcp);
+
 void usage(void);
 void unix_error(char *msg);
 void app_error(char *msg);
 typedef void handler_t(int);
 handler_t *Signal(int signum, handler_t *handler);
+void *Malloc(size_t size);
+void *Realloc(void *ptr, size_t size);
+char *savestr(const char *s, int len);
+char *readcmdline(char *buf, int size);
+void waitinput(void);
 
 /*
  * main - The shell's main routine 
@@ -93,10 +366,14 @@ int main(int argc, char **argv) {
     char c;
     char cmdline[MAXLINE];
     int emit_prompt = 1; /* emit prompt (default) */
+    int editing;         /* edit lines in the terminal */
+    char *script = NULL; /* lines of a compound command still open */
+    size_t len = 0, cap = 0;
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(STDOUT_FILENO, STDERR_FILENO);
+    shellout = stdout;
 
     /* Parse the command line */
     while ((c = getopt(argc, argv, "hvp")) != -1) {
@@ -130,98 +407,555 @@ int main(int argc, char **argv) {
     /* Initialize the job list */
     initjobs(jobs);
 
+    /* Edit command lines in place when a person is typing them */
+    editing = emit_prompt && isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+
     /* Execute the shell's read/eval loop */
     while (1) {
 
         /* Read command line */
-        if (emit_prompt) {
-            printf("%s", prompt);
-            fflush(stdout);
+        char *line;
+        if (editing)
+            line = editline(len ? "> " : prompt, cmdline, MAXLINE);
+        else {
+            if (emit_prompt) {
+                printf("%s", len ? "> " : prompt);
+                fflush(stdout);
+            }
+            line = readcmdline(cmdline, MAXLINE);
         }
-        if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-            app_error("fgets error");
-        if (feof(stdin)) { /* End of file (ctrl-d) */
+        if (line == NULL) { /* End of file (ctrl-d) */
+            if (len)
+                printf("tsh: syntax error: unexpected end of file\n");
             fflush(stdout);
             exit(0);
         }
 
-        /* Evaluate the command line */
-        eval(cmdline);
+        /* Evaluate the command line. If it opens an if/while/for or
+         * function that is not closed yet, keep collecting lines and
+         * evaluate them together once the construct is complete. A
+         * line longer than cmdline arrives in pieces, and lines of a
+         * here-document are only collected until its delimiter. */
+        size_t n = strlen(cmdline);
+        int whole = n > 0 && cmdline[n - 1] == '\n';
+        int tried = 0;
+        if (len == 0 && whole) {
+            if (eval(cmdline)) {
+                fflush(stdout);
+                continue;
+            }
+            tried = 1;
+        }
+        if (len + n + 1 > cap) {
+            cap = 2 * (len + n + 1);
+            script = Realloc(script, cap);
+        }
+        memcpy(script + len, cmdline, n + 1);
+        len += n;
+        if (!tried && whole && (heredoc[0] == '\0' || strcmp(cmdline, heredoc) == 0)
+                && eval(script))
+            len = 0;
         fflush(stdout);
     } 
 
     exit(0); /* control never reaches here */
 }
 
+/*
+ * readcmdline - fgets from stdin, except that deadlines that fall due
+ *    while the shell waits for the line are acted on at once. Returns
+ *    NULL on end of file, dropping an unterminated last line as fgets
+ *    and feof did.
+ */
+char *readcmdline(char *buf, int size) {
+    static char in[65536];
+    static int pos, len;
+    int n = 0;
+
+    while (n < size - 1) {
+        if (pos == len) {
+            waitinput();
+            if ((len = read(STDIN_FILENO, in, sizeof(in))) < 0) {
+                len = 0;
+                if (errno == EINTR || errno == EAGAIN)
+                    continue;
+                app_error("read error");
+            }
+            pos = 0;
+            if (len == 0)
+                return NULL;
+        }
+        if ((buf[n++] = in[pos++]) == '\n')
+            break;
+    }
+    buf[n] = '\0';
+    return buf;
+}
+
+/*
+ * waitinput - Wait until stdin is readable or at end of file. Deadlines
+ *    that fall due meanwhile are acted on at once, and changes to the
+ *    PATH directories are applied to the command index as they happen.
+ */
+void waitinput(void) {
+    struct pollfd pfd[3] = {{STDIN_FILENO, POLLIN, 0}, {-1, POLLIN, 0},
+                            {-1, POLLIN, 0}};
+    sigset_t mask, prev;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    while (1) {
+        pfd[1].fd = wheel.fd;
+        pfd[2].fd = cmdidx.fd;
+        pfd[0].revents = pfd[1].revents = pfd[2].revents = 0;
+        if (poll(pfd, 3, -1) < 0 && errno != EINTR)
+            unix_error("poll error");
+        if (pfd[1].revents & POLLIN) {
+            sigprocmask(SIG_BLOCK, &mask, &prev);
+            twexpire();
+            sigprocmask(SIG_SETMASK, &prev, NULL);
+        }
+        if (pfd[2].revents & POLLIN)
+            pathsync();
+        if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))
+            return;
+    }
+}
+
+/* hereop - Is s "<<" or "<<<", whose next word is text, not syntax? */
+int hereop(const char *s) {
+    return strcmp(s, "<<") == 0 || strcmp(s, "<<<") == 0;
+}
+
+/*
+ * bgjob - Does the command end in an "&" that puts it in the background,
+ *    rather than one that is the text of a here-string?
+ */
+int bgjob(char **argv, int argc) {
+    int i;
+
+    if (argc == 0 || strcmp(argv[argc - 1], "&") != 0)
+        return 0;
+    for (i = 0; i < argc - 1; i++)
+        if (hereop(argv[i]))
+            i++;
+    return i == argc - 1;
+}
+
+/*
+ * pipeop - Is s a pipe operator? "|" connects two stages one-to-one;
+ *    "|&N" runs the next stage as up to N concurrent copies, each fed
+ *    whole lines of the input, and "|&No" also keeps their output in
+ *    input order. Returns 1 and sets *copies (0 for "|") if it is one,
+ *    -1 for a "|&" with a bad count, and 0 otherwise.
+ */
+int pipeop(const char *s, int *copies, int *ordered) {
+    char *end;
+    long n;
+
+    *copies = *ordered = 0;
+    if (s[0] != '|')
+        return 0;
+    if (s[1] == '\0')
+        return 1;
+    if (s[1] != '&')
+        return 0;
+    n = strtol(s + 2, &end, 10);
+    if (end == s + 2 || n < 1 || n > MAXFANOUT)
+        return -1;
+    if (*end == 'o') {
+        *ordered = 1;
+        end++;
+    }
+    if (*end != '\0')
+        return -1;
+    *copies = n;
+    return 1;
+}
+
+/*
+ * lastnl - Offset just past the last newline in [from, to) of fd, or -1
+ */
+off_t lastnl(int fd, off_t from, off_t to, char *buf, size_t size) {
+    while (to > from) {
+        size_t n = to - from < (off_t)size ? to - from : size;
+        if (pread(fd, buf, n, to - n) != (ssize_t)n)
+            return -1;
+        char *nl = memrchr(buf, '\n', n);
+        if (nl != NULL)
+            return to - n + (nl - buf) + 1;
+        to -= n;
+    }
+    return -1;
+}
+
+/*
+ * nextchunk - Cut the next run of whole lines off stdin into a memfd,
+ *    rewound and ready to be a command's stdin. The chunk starts with
+ *    the partial line carried over from the previous one, is topped up
+ *    to FANOUT_CHUNK bytes by splicing straight from the pipe, and is
+ *    then cut back to its last newline; what follows is carried over.
+ *    Sets *eof once stdin is drained and *size to the chunk's length.
+ */
+int nextchunk(char **carry, size_t *ncarry, size_t *carrycap, off_t *size, int *eof) {
+    static char buf[65536];
+    off_t off, want = FANOUT_CHUNK, from;
+    ssize_t n;
+    int fd;
+
+    if ((fd = memfd_create("tsh-fanout", MFD_CLOEXEC)) < 0)
+        return -1;
+    if (*ncarry > 0 && write(fd, *carry, *ncarry) != (ssize_t)*ncarry) {
+        close(fd);
+        return -1;
+    }
+    off = from = *ncarry; /* the carried text has no newline */
+    *ncarry = 0;
+
+    while (1) {
+        while (off < want && !*eof) {
+            n = splice(STDIN_FILENO, NULL, fd, &off, want - off, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINVAL) { /* stdin is no pipe: copy */
+                if ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0
+                        && pwrite(fd, buf, n, off) == n)
+                    off += n;
+                else if (n > 0)
+                    n = -1;
+            }
+            if (n == 0)
+                *eof = 1;
+            else if (n < 0 && errno != EINTR) {
+                close(fd);
+                return -1;
+            }
+        }
+        if (*eof)
+            break;
+
+        /* Carry the partial last line over to the next chunk; a line
+         * longer than a whole chunk makes this chunk grow instead */
+        off_t cut = lastnl(fd, from, off, buf, sizeof(buf));
+        if (cut >= 0) {
+            if (off - cut > (off_t)*carrycap) {
+                *carrycap = off - cut;
+                *carry = Realloc(*carry, *carrycap);
+            }
+            *ncarry = off - cut;
+            if (pread(fd, *carry, *ncarry, cut) != (ssize_t)*ncarry
+                    || ftruncate(fd, cut) < 0) {
+                close(fd);
+                return -1;
+            }
+            off = cut;
+            break;
+        }
+        from = off;
+        want += FANOUT_CHUNK;
+    }
+
+    *size = off;
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/*
+ * copyout - Copy a finished chunk's output memfd to stdout, by splice
+ *    when stdout is a pipe. Returns -1 if stdout went away.
+ */
+int copyout(int fd) {
+    static char buf[65536];
+    loff_t off = 0;
+    ssize_t n;
+
+    while ((n = splice(fd, &off, STDOUT_FILENO, NULL, 1 << 20, SPLICE_F_MOVE)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno != EINVAL)
+            return -1;
+        if (n < 0) { /* stdout is a file or terminal: copy */
+            while ((n = pread(fd, buf, sizeof(buf), off)) > 0) {
+                for (ssize_t done = 0, w; done < n; done += w)
+                    if ((w = write(STDOUT_FILENO, buf + done, n - done)) < 0) {
+                        if (errno != EINTR)
+                            return -1;
+                        w = 0;
+                    }
+                off += n;
+            }
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * fanout - Run a |&N pipeline stage: argv as up to n concurrent copies
+ *    over successive chunks of stdin, each chunk a memfd of whole lines
+ *    (nextchunk) with another memfd collecting that copy's output. A
+ *    chunk's output goes to stdout in one piece once its copy exits, so
+ *    lines of different copies never interleave; with ordered set the
+ *    pieces are released in input order. Empty input still runs argv
+ *    once. The status follows grep's rule over the whole input: 0 if any
+ *    copy exits 0, else the highest status of the copies.
+ */
+int fanout(char **argv, int n, int ordered) {
+    struct {
+        pid_t pid;          /* copy running this chunk, 0 if slot free */
+        long seq;           /* chunk number in input order */
+        int out;            /* memfd holding the copy's output */
+        int done;           /* copy has exited */
+    } slot[MAXFANOUT];
+    char *carry = NULL;
+    size_t ncarry = 0, carrycap = 0;
+    long seq = 0, next = 0; /* next chunk to cut, next to emit */
+    int busy = 0, running = 0, eof = 0, worst = 0, anyok = 0, broken = 0;
+    off_t size;
+    pid_t pid;
+    int i, st;
+
+    /* This process waits for its copies itself */
+    Signal(SIGCHLD, SIG_DFL);
+    Signal(SIGINT, SIG_DFL);
+    Signal(SIGTSTP, SIG_DFL);
+    Signal(SIGPIPE, SIG_IGN);
+    fcntl(STDIN_FILENO, F_SETPIPE_SZ, 1 << 20); /* fewer, larger splices */
+    for (i = 0; i < n; i++)
+        slot[i].pid = 0;
+
+    while (!eof || busy > 0) {
+        while (busy < n && !eof) {
+            int in = nextchunk(&carry, &ncarry, &carrycap, &size, &eof);
+            if (in < 0) {
+                perror("fan-out");
+                eof = 1;
+                broken = 1;
+                break;
+            }
+            if (size == 0 && seq > 0) {
+                close(in);
+                break;
+            }
+            for (i = 0; slot[i].pid != 0; i++)
+                ;
+            if ((slot[i].out = memfd_create("tsh-fanout", MFD_CLOEXEC)) < 0
+                    || (pid = fork()) < 0) {
+                perror("fan-out");
+                _exit(1);
+            }
+            if (pid == 0) {
+                Signal(SIGPIPE, SIG_DFL);
+                dup2(in, STDIN_FILENO);
+                dup2(slot[i].out, STDOUT_FILENO);
+                execvp(argv[0], argv);
+                fprintf(stderr, "Command failure: %s\n", argv[0]);
+                _exit(1);
+            }
+            close(in);
+            slot[i].pid = pid;
+            slot[i].seq = seq++;
+            slot[i].done = 0;
+            busy++;
+            running++;
+        }
+
+        /* Release finished output: any of it, or the next in order */
+        for (i = 0; i < n; i++) {
+            if (slot[i].pid == 0 || !slot[i].done || (ordered && slot[i].seq != next))
+                continue;
+            if (copyout(slot[i].out) < 0) { /* reader is gone */
+                for (int j = 0; j < n; j++)
+                    if (slot[j].pid != 0 && !slot[j].done)
+                        kill(slot[j].pid, SIGTERM);
+                _exit(141);
+            }
+            close(slot[i].out);
+            slot[i].pid = 0;
+            busy--;
+            next++;
+            i = -1; /* the next in order may be done already */
+        }
+
+        if (running == 0)
+            continue;
+        if ((pid = waitpid(-1, &st, 0)) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("fan-out");
+            _exit(1);
+        }
+        for (i = 0; i < n; i++)
+            if (slot[i].pid == pid && !slot[i].done) {
+                slot[i].done = 1;
+                running--;
+                st = WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st);
+                worst = st > worst ? st : worst;
+                anyok |= st == 0;
+            }
+    }
+    free(carry);
+    if (broken)
+        return 1;
+    return anyok ? 0 : worst;
+}
+
+/*
+ * execpipeline - Run a pipeline as one job: every stage is started at
+ *    once in the process group of the first, with stdout of each piped
+ *    into stdin of the next, and the job ends when the last process of
+ *    it exits. Its status is the last stage's. A stage after "|&N" is
+ *    run by fanout. The stage descriptors come from the arena and point
+ *    into commands, which each child cuts at the end of its own stage.
+ */
 void execpipeline(char **commands, int num_cmds, sigset_t *masker, char *cmdline) { 
     int piper[2];
     int fdfla = -1;
     int c1 = 0;
-    int c2 = -1;
-    char *pipcmds[MAXARGS][MAXARGS];
+    int c2 = 0;
+    struct stage_t *stages; // Stage descriptors, in the arena
+    pid_t pgid = 0;         // Process group, the first stage's PID
     
     // Checker for foreground or backgroudn job
     int bgflag = 0;
-    if (strcmp(commands[num_cmds - 1],"&") == 0){bgflag = 1;}
+    if (bgjob(commands, num_cmds)){bgflag = 1; num_cmds--;}
+
+    // There are at most half as many stages as words, plus one
+    if ((stages = aalloc((num_cmds / 2 + 1) * sizeof(struct stage_t))) == NULL) {
+        printf("tsh: command too long\n");
+        fgstatus = 2;
+        sigprocmask(SIG_SETMASK, masker, NULL);
+        return;}
 
-    // Make a secondary commands list[argv 2.0] for ease in pipeline
-    // execution
+    // Split the words into stages at the pipe operators
+    stages[0].argv = commands;
+    stages[0].copies = 0;
+    stages[0].ordered = 0;
     for (int j= 0; j < num_cmds; j++) {
-        if (!strcmp(commands[j], "|") == 0) {c2 ++;
-            pipcmds[c1][c2] = commands[j];} 
-        else {c2 = -1; c1 ++;}
+        int n, ord, w = pipeop(commands[j], &n, &ord);
+        if (w == 0 && hereop(commands[j]) && j + 1 < num_cmds) {c2 += 2; j++;}
+        else if (w == 0) {c2 ++;}
+        else if (w < 0 || c2 == 0 || c1 + 1 >= MAXPROCS) {
+            printf("tsh: syntax error near %s\n", commands[j]);
+            fgstatus = 2;
+            sigprocmask(SIG_SETMASK, masker, NULL);
+            return;}
+        else {stages[c1].argc = c2; c2 = 0; c1 ++;
+            stages[c1].argv = commands + j + 1;
+            stages[c1].copies = n;
+            stages[c1].ordered = ord;}
     } 
+    if (c2 == 0) {
+        printf("tsh: syntax error near %s\n", commands[num_cmds - 1]);
+        fgstatus = 2;
+        sigprocmask(SIG_SETMASK, masker, NULL);
+        return;}
+    stages[c1].argc = c2;
     c1 = c1 + 1;
     
-    //Evaluating list of commands as per pipes
-    int k = 0;
-    while (k < c1) {
-        if (pipe(piper) != 0) {printf("Piping Error"); 
-            exit(1);}
+    // Start every stage before waiting on any, so a stage that writes
+    // more than a pipe holds cannot stall the ones after it
+    for (int k = 0; k < c1; k++) {
+        if (k + 1 < c1 && pipe(piper) != 0) {perror("pipe"); break;}
             
         pid_t pid = fork();
         // Child progess
         if (pid == 0) {
+            sigprocmask(SIG_SETMASK, masker, NULL);
+            if (!nojobctl) {setpgid(0, pgid);}
             
             // To redirect the standard output on condition
-            if (k + 1 < c1) {dup2(piper[1], STDOUT_FILENO);}
+            if (k + 1 < c1) {dup2(piper[1], STDOUT_FILENO);
+                close(piper[0]);
+                close(piper[1]);}
             // To redirect the standard input on condition
             if (fdfla != -1) {dup2 (fdfla, STDIN_FILENO);
                 close (fdfla);}
+            struct stage_t *sg = &stages[k];
+            sg->argv[sg->argc] = NULL;
+            if (ioredirection(sg->argv) < 0) {_exit(1);}
 
-            // Execute the command, raise error for improper execution
-            if (execvp (pipcmds[k][0], pipcmds[k]) < 0) {
-                fprintf(stderr, "Command failure: %s\n", pipcmds[k][0]);
-                exit(1);
+            // Fan the stage out over its input, or execute the command,
+            // raise error for improper execution
+            if (sg->copies > 0) {_exit(fanout(sg->argv, sg->copies, sg->ordered));}
+            if (execvp (sg->argv[0], sg->argv) < 0) {
+                fprintf(stderr, "Command failure: %s\n", sg->argv[0]);
+                _exit(1);
             }
-            close(piper[0]);}
+        }
 
         // If forking not done right and properly
-        else if (pid < 0) { perror("fork"); exit(1);} 
+        else if (pid < 0) {perror("fork"); break;} 
 
         // If parent instead of child
         else {
-            if (fdfla != -1) {close (fdfla);}
+            // All stages form one job; signals stay blocked until it
+            // is listed, so none can be reaped before that
+            if (!nojobctl) {setpgid(pid, pgid ? pgid : pid);}
+            if (pgid == 0) {pgid = pid;
+                addjob(jobs, pid, bgflag ? BG : FG, cmdline);}
+            else {addproc(getjobpid(jobs, pgid), pid);}
 
             // Proper closing of the pipe and redirections
-            fdfla = piper[0];
-            close(piper[1]);
+            if (fdfla != -1) {close (fdfla); fdfla = -1;}
+            if (k + 1 < c1) {fdfla = piper[0];
+                close(piper[1]);}
+        }
+    }
+    if (fdfla != -1) {close (fdfla);}
+    sigprocmask(SIG_SETMASK, masker, NULL);
+    if (pgid == 0) {fgstatus = 1; return;}
              
-            // Work needed for a background or foreground process
-            sigprocmask(SIG_SETMASK, masker, NULL);
-            if (!bgflag) {// Foreground job
-                addjob(jobs, pid, FG, cmdline);
-                waitfg(fgpid(jobs));} 
-            else {// Background job
-                addjob(jobs, pid, BG, cmdline);
-                printf("[%d] (%d) %s", pid2jid(pid), pid, getjobpid(jobs,pid) -> cmdline);
-            }
+    // Work needed for a background or foreground process
+    if (!bgflag) {// Foreground job
+        waitfg(pgid);} 
+    else {// Background job
+        printf("[%d] (%d) %s", pid2jid(pgid), pgid, cmdline);
+    }
+}
+
+/*
+ * herefd - Return a descriptor that reads back text, plus a newline for
+ *    a here-string. Text that fits in one atomic pipe write goes
+ *    through a pipe; anything larger is put in an anonymous memfd, so
+ *    writing it can never block on a reader and it never touches disk.
+ */
+int herefd(const char *text, int newline) {
+    size_t len = strlen(text);
+    int fd[2];
+
+    if (len + newline <= PIPE_BUF) {
+        if (pipe(fd) < 0)
+            return -1;
+        if (write(fd[1], text, len) != (ssize_t)len
+                || (newline && write(fd[1], "\n", 1) != 1)) {
+            close(fd[0]);
+            close(fd[1]);
+            return -1;
+        }
+        close(fd[1]);
+        return fd[0];
+    }
+
+    if ((fd[0] = memfd_create("tsh-heredoc", MFD_CLOEXEC)) < 0)
+        return -1;
+    while (len > 0) {
+        ssize_t n = write(fd[0], text, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            close(fd[0]);
+            return -1;
         }
-    k++;
+        text += n;
+        len -= n;
     }
+    if ((newline && write(fd[0], "\n", 1) != 1) || lseek(fd[0], 0, SEEK_SET) < 0) {
+        close(fd[0]);
+        return -1;
+    }
+    return fd[0];
 }
-  
-void ioredirection(char **argv){
+
+int ioredirection(char **argv){
     int input_f = -1; // Needed for input redirection
     int output_f = -1; // Needed for output redirection
     for (int i = 0; argv[i] != NULL; i++) {
@@ -229,9 +963,9 @@ void ioredirection(char **argv){
         // When input redirection is needed
         if (strcmp(argv[i], "<") == 0) {
             input_f = open(argv[i + 1], O_RDONLY);
-            if (input_f < 0) { 
+            if (input_f < 0) {
                 perror("Input redirection error");
-                exit(1);
+                return -1;
             }
             dup2(input_f, STDIN_FILENO);
             //Redirect stdint into the input file opened
@@ -239,19 +973,36 @@ void ioredirection(char **argv){
             argv[i] = NULL; // Remove the redirection for later work
             }
         
+        // Here-document (<<) or here-string (<<<): the text is stdin
+        else if (hereop(argv[i])) {
+            if (argv[i + 1] == NULL) {
+                fprintf(stderr, "tsh: %s: missing text\n", argv[i]);
+                return -1;
+            }
+            if ((input_f = herefd(argv[i + 1], argv[i][2] == '<')) < 0) {
+                perror("Here-document error");
+                return -1;
+            }
+            dup2(input_f, STDIN_FILENO);
+            close(input_f);
+            argv[i++] = NULL; // The text itself is not a redirection
+        }
+
         // When output redirection is needed
         else if (strcmp(argv[i], ">") == 0) {
             output_f = open(argv[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
             if (output_f < 0) {
                 perror("Output redirection error");
-                exit(1);
+                return -1;
             }
-            dup2(output_f, STDOUT_FILENO); 
+            dup2(output_f, STDOUT_FILENO);
             //Redirect stdout into the output file opened
             close(output_f);
             argv[i] = NULL; // Remove the redirection for later work
         }
-}}
+}
+    return 0;
+}
   
 /* 
  * eval - Evaluate the command line that the user has just typed in
@@ -263,37 +1014,102 @@ void ioredirection(char **argv){
  * each child process must have a unique process group ID so that our
  * background children don't receive SIGINT (SIGTSTP) from the kernel
  * when we type ctrl-c (ctrl-z) at the keyboard.  
+ *
+ * The text is compiled once into a list of command nodes and run from
+ * that form, so loop and function bodies are never re-parsed. All of
+ * it lives in the per-command arena, which is reset here. Returns
+ * 0 if the text opens an if/while/for/function that is not closed
+ * yet; the caller should then append more lines and call eval again.
 */
-void eval(char *cmdline) {
-    char **argv = malloc(sizeof(char *) * MAXARGS); 
-    int bgrt; 
+int eval(char *cmdline) {
+    struct node_t *prog;
+    size_t mark = amark();
+    int rc = compile(cmdline, &prog);
+
+    if (rc == 0){
+        intr = 0;
+        execlist(prog);
+        loopctl = 0;
+    }
+    else if (rc > 0){
+        status = 2; // As sh does for a syntax error
+    }
+
+    // All of it was in the arena, bar function bodies not yet defined
+    dropfuncs(prog);
+    arelease(mark);
+
+    // Compound command still open, wait for the rest of it
+    return rc >= 0;
+    }
+
+/* 
+ * runcmd - Run one expanded command line: a builtin, a pipeline or a
+ *    single program in its own process group. Returns the exit status,
+ *    which is also left in status ($?).
+ */
+int runcmd(char **argv, int argc, char *cmdline) {
     pid_t pid; 
     int bgflag = 0; // Background or foreground?
     int pipeflag = 0; // Flag for if pipes are there or not?
-    //char *commandls[MAXLINE];
+    int redirflag = 0; // Flag for < or > on a builtin
     sigset_t masker, masker2;
     
-    bgrt = parseline(cmdline, argv);
-    
     // Go through the list and check for a pipe, to raise pipeflag
     for (int i=0; argv[i] != NULL; i++){
-        if (strcmp(argv[i], "|") == 0){pipeflag = 1;}}
+        int n, ord;
+        if (pipeop(argv[i], &n, &ord) != 0){pipeflag = 1;}
+        else if (strcmp(argv[i], "<") == 0 || strcmp(argv[i], ">") == 0){redirflag = 1;}
+        else if (hereop(argv[i])){
+            redirflag = 1;
+            if (argv[i + 1] != NULL){i++;} // The text is never an operator
+        }}
 
     // Incase no arguments are returned[Commandline is empty]
-    if (argv[0] == NULL){return;}
-    
+    if (argv[0] == NULL){return status;}
+
+    // A timeout prefix gives the job started by the rest a deadline
+    if (strcmp(argv[0], "timeout") == 0){
+        long ms = argv[1] ? parseduration(argv[1]) : -1;
+        if (ms < 0 || argv[2] == NULL){
+            printf("timeout: usage: timeout DURATION command\n");
+            return status = 125;
+        }
+        timeoutms = ms;
+        runcmd(argv + 2, argc - 2, cmdline);
+        timeoutms = 0;
+        return status;
+    }
+
     // Work for pipes being done here, through an external command
-    else if (pipeflag){
+    if (pipeflag){
+        fflush(stdout); // Buffered builtin output must not reach children
         sigemptyset(&masker);
         sigaddset(&masker, SIGCHLD);
         sigaddset(&masker, SIGINT);
         sigaddset(&masker, SIGTSTP);
         sigprocmask(SIG_BLOCK, &masker, &masker2);
-        execpipeline(argv, bgrt, &masker2, cmdline);}
+        execpipeline(argv, argc, &masker2, cmdline);
+        status = bgjob(argv, argc) ? 0 : fgstatus;}
+
+    // Builtins with redirections run in the shell with stdin/stdout
+    // temporarily pointed at the files
+    else if (redirflag && isbuiltin(argv[0])){
+        fflush(stdout);
+        int savein = dup(STDIN_FILENO);
+        int saveout = dup(STDOUT_FILENO);
+        if (ioredirection(argv) == 0){builtin_cmd(argv);}
+        else {status = 1;}
+        fflush(stdout);
+        dup2(savein, STDIN_FILENO);
+        dup2(saveout, STDOUT_FILENO);
+        close(savein);
+        close(saveout);
+    }
 
     // If a built in commdand is found, this is addressed immediately
     else if (builtin_cmd(argv)){
-        return;
+        return status;
     }
     else {
 
@@ -305,50 +1121,54 @@ void eval(char *cmdline) {
         sigaddset(&masker, SIGINT);
         sigprocmask(SIG_BLOCK, &masker, NULL);
 
-        if (strcmp(argv[bgrt - 1],"&") == 0){bgflag = 1;}
+        if (bgjob(argv, argc)){bgflag = 1;}
 
+        fflush(stdout); // Buffered builtin output must not reach children
         pid = fork();
         if (pid == 0) { // Child process
             sigprocmask(SIG_UNBLOCK, &masker, NULL);
-            setpgid(0, 0);
+            if (!nojobctl) {setpgid(0, 0);}
 
             // Work done for input/output redirection if needed, 
             // is handled here
-            ioredirection(argv);
+            if (ioredirection(argv) < 0){_exit(1);}
             
             //In case a background process was raised, in order to
             //add delimiter/null terminator back
-            if (bgflag){argv[bgrt-1] = '\0';}
+            if (bgflag){argv[argc-1] = NULL;}
             
             //Command execution
+            // _exit keeps a script read from a file at its offset
             if (execvp(argv[0], argv) < 0) { 
                 printf("%s: Command not found.\n", argv[0]);
-                exit(1);
+                fflush(stdout);
+                _exit(1);
             }
         }
 
         // Forking done incorrectly
         else if (pid < 0) {
+            sigprocmask(SIG_UNBLOCK, &masker, NULL);
             printf("Forking error.\n");
-            return;}
+            return status = 1;}
 
         // Parent process
-        // Signals are unblocked here as was said earlier
-        setpgid(pid,pid);
+        // The job is added before signals are unblocked, so a child
+        // that exits at once cannot be reaped before it is listed
+        if (!nojobctl) {setpgid(pid,pid);}
+        addjob(jobs, pid, bgflag ? BG : FG, cmdline);
         sigprocmask(SIG_UNBLOCK, &masker, NULL);
-        Signal(SIGTSTP,sigtstp_handler);
-        Signal(SIGINT,sigint_handler);
         
-        if (!bgflag) {// Background job
-            addjob(jobs, pid, FG, cmdline);
-            waitfg(fgpid(jobs));
+        if (!bgflag) {// Foreground job
+            waitfg(pid);
+            status = fgstatus;
             } 
-        else {// Foreground job
-            addjob(jobs, pid, BG, cmdline);
+        else {// Background job
             printf("[%d] (%d) %s", pid2jid(pid), pid, getjobpid(jobs,pid) -> cmdline);
+            status = 0;
             }
         }
-    return;
+    return status;
     }
  
 /* 
@@ -405,6 +1225,12 @@ int parseline(const char *cmdline, char **argv) {
 int builtin_cmd(char **argv) {
     char* input = argv[0];
 
+    if (!isbuiltin(input)){
+        return 0; /* not a builtin command */
+    }
+    int last = status; // A bare return keeps the status it found
+    status = 0;
+
     if (strcmp(input, "quit") == 0){ //exit clause
         exit(0);
     }
@@ -420,8 +1246,175 @@ int builtin_cmd(char **argv) {
         listjobs(jobs);
         return 1;
     }
+    else if (strcmp(input, "deadline") == 0){
+        status = do_deadline(argv);
+    }
+    else if (strcmp(input, "dag") == 0){
+        status = do_dag(argv);
+    }
+    else if (strcmp(input, "false") == 0){
+        status = 1;
+    }
+    else if (strcmp(input, "echo") == 0){
+        status = do_echo(argv);
+    }
+    else if (strcmp(input, "test") == 0 || strcmp(input, "[") == 0){
+        status = do_test(argv);
+    }
+    else if (strcmp(input, "break") == 0 || strcmp(input, "continue") == 0){
+        if (loopdepth == 0){
+            printf("%s: only meaningful in a loop\n", input);
+            status = 1;
+        }
+        else {
+            loopctl = input[0] == 'b' ? L_BREAK : L_CONTINUE;
+        }
+    }
+    else if (strcmp(input, "return") == 0){
+        if (funcdepth == 0){
+            printf("return: can only return from a function\n");
+            status = 1;
+        }
+        else {
+            status = argv[1] ? atoi(argv[1]) : last;
+            loopctl = L_RETURN;
+        }
+    }
+    return 1; /* true and : just succeed */
+}
+
+/* The commands that builtin_cmd runs in the shell */
+const char *builtins[] = {"quit", "fg", "bg", "jobs", "true", ":",
+    "false", "echo", "test", "[", "break", "continue", "return",
+    "deadline", "dag", NULL};
+
+/* 
+ * isbuiltin - Is name a command that builtin_cmd runs in the shell?
+ */
+int isbuiltin(const char *name) {
+    for (int i = 0; builtins[i] != NULL; i++)
+        if (strcmp(name, builtins[i]) == 0)
+            return 1;
+    return 0;
+}
+
+/* 
+ * do_echo - Execute the builtin echo: print the arguments separated by
+ *    spaces. -n suppresses the trailing newline.
+ */
+int do_echo(char **argv) {
+    int i = 1;
+    int newline = 1;
+
+    if (argv[1] != NULL && strcmp(argv[1], "-n") == 0){
+        newline = 0;
+        i++;
+    }
+    for (; argv[i] != NULL; i++){
+        fputs(argv[i], stdout);
+        if (argv[i + 1] != NULL){putchar(' ');}
+    }
+    if (newline){putchar('\n');}
+    return 0;
+}
+
+/* 
+ * do_test - Execute the builtin test (and [): string and integer
+ *    comparisons, -n/-z and -e/-f/-d file checks, and ! negation.
+ *    Returns 0 for true, 1 for false and 2 for a malformed expression.
+ */
+int do_test(char **argv) {
+    int argc = 0;
+    int neg = 0;
+    int r;
+    char **a = argv + 1;
+    struct stat sb;
+
+    while (argv[argc] != NULL){argc++;}
+    if (strcmp(argv[0], "[") == 0){
+        if (strcmp(argv[argc - 1], "]") != 0){
+            printf("[: missing ]\n");
+            return 2;
+        }
+        argc--;
+    }
+    argc--;
+    if (argc > 0 && strcmp(a[0], "!") == 0){
+        neg = 1;
+        a++;
+        argc--;
+    }
+
+    if (argc == 0){r = 0;}
+    else if (argc == 1){r = a[0][0] != '\0';}
+    else if (argc == 2){
+        if (strcmp(a[0], "-n") == 0){r = a[1][0] != '\0';}
+        else if (strcmp(a[0], "-z") == 0){r = a[1][0] == '\0';}
+        else if (strcmp(a[0], "-e") == 0){r = stat(a[1], &sb) == 0;}
+        else if (strcmp(a[0], "-f") == 0){r = stat(a[1], &sb) == 0 && S_ISREG(sb.st_mode);}
+        else if (strcmp(a[0], "-d") == 0){r = stat(a[1], &sb) == 0 && S_ISDIR(sb.st_mode);}
+        else {
+            printf("%s: unknown operator %s\n", argv[0], a[0]);
+            return 2;
+        }
+    }
+    else if (argc == 3){
+        long x = strtol(a[0], NULL, 10);
+        long y = strtol(a[2], NULL, 10);
+        char *op = a[1];
+        if (strcmp(op, "=") == 0){r = strcmp(a[0], a[2]) == 0;}
+        else if (strcmp(op, "!=") == 0){r = strcmp(a[0], a[2]) != 0;}
+        else if (strcmp(op, "-eq") == 0){r = x == y;}
+        else if (strcmp(op, "-ne") == 0){r = x != y;}
+        else if (strcmp(op, "-lt") == 0){r = x < y;}
+        else if (strcmp(op, "-le") == 0){r = x <= y;}
+        else if (strcmp(op, "-gt") == 0){r = x > y;}
+        else if (strcmp(op, "-ge") == 0){r = x >= y;}
+        else {
+            printf("%s: unknown operator %s\n", argv[0], op);
+            return 2;
+        }
+    }
+    else {
+        printf("%s: too many arguments\n", argv[0]);
+        return 2;
+    }
+    return r == neg;
+}
+
+/* 
+ * do_deadline - Execute the builtin deadline: give the job named by
+ *    PID or %jid a deadline DURATION from now, replacing any it has.
+ *    A DURATION of 0 removes the deadline.
+ */
+int do_deadline(char **argv) {
+    struct job_t *job;
+    sigset_t mask, prev;
+    long ms;
 
-    return 0;     /* not a builtin command */
+    if (argv[1] == NULL || argv[2] == NULL){
+        printf("deadline: command requires PID or %%jid and DURATION\n");
+        return 2;
+    }
+    if ((ms = parseduration(argv[2])) < 0){
+        printf("deadline: invalid duration %s\n", argv[2]);
+        return 2;
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    if (argv[1][0] == '%'){job = getjobjid(jobs, atoi(argv[1] + 1));}
+    else {job = getjobpid(jobs, atoi(argv[1]));}
+    if (job == NULL || job->timedout){
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        printf(job ? "%s: Already timed out\n" : "%s: No such job\n", argv[1]);
+        return 1;
+    }
+    if (ms == 0){twcancel(&job->deadline);}
+    else {twarm(&job->deadline, ms);}
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return 0;
 }
 
 /* 
@@ -492,7 +1485,7 @@ void do_bgfg(char **argv) {
             if (curr->state==ST){
                 //printf("HERE BG2");
                 curr->state=BG;
-                kill(curr->pid, SIGCONT);
+                signaljob(curr, SIGCONT); // Every stage of a pipeline
             }
             printf("[%d] (%d) %s", curr->jid, curr->pid, curr->cmdline);
             // kill(curr->pid, SIGCONT);
@@ -502,14 +1495,14 @@ void do_bgfg(char **argv) {
             if (curr->state==ST){
                 //waitfg(pid);
                 curr->state=FG;
-                kill(-(curr->pid), SIGCONT);
+                signaljob(curr, SIGCONT);
                 waitfg(pid);
                 }
             else if (curr->state==BG){
                 // waitfg(pid);
                 //waitfg(fgpid(jobs));
                 curr->state=FG;
-                kill(-(curr->pid), SIGCONT);
+                signaljob(curr, SIGCONT);
                 waitfg(fgpid(jobs));
             }
             // printf("[%d] (%d) %s", curr->jid, curr->pid, curr->cmdline);
@@ -537,7 +1530,7 @@ void waitfg(pid_t pid) {
         // printf("508\n");
         // printf("\n %d   %d  in the loop\n", pid, fgpid(jobs));
         // fflush(stdout);
-        sigsuspend(&prev_mask); // Wait for SIGCHLD to be received
+        twwait(&prev_mask); // Wait for SIGCHLD to be received, or a deadline
 
     }
 
@@ -565,19 +1558,46 @@ void sigchld_handler(int sig) {
 
     while ((group_pid = waitpid(-1, &sta, WNOHANG | WUNTRACED)) > 0){ //Adapted from textbook, WNOHANG option is used since 
             //we do not wait for currently running children to temrination.
-        struct job_t* job_handle = getjobpid(jobs, group_pid); // Used to have refernce to job whose status is to change from fg -> bg.
+        // A pipeline is one job of several processes; it is reported
+        // under its leader and ends when the last of them has exited
+        struct job_t* job_handle = getjobproc(jobs, group_pid); // Used to have refernce to job whose status is to change from fg -> bg.
+        pid_t leader = job_handle ? job_handle->pid : group_pid;
 
-        if(WIFSIGNALED(sta)){
-            printf("Job [%d] (%d) terminated by signal 2\n",pid2jid(group_pid) ,group_pid); 
-            deletejob(jobs, group_pid);
-        }   
-        else if(WIFEXITED(sta)){
-            deletejob(jobs, group_pid); // Delete the job as it is now done and complete, no need for it to occupy space in the job list. 
+        // Remember how a foreground child ended, for $? and conditions
+        if (job_handle == NULL || (job_handle->state != BG && group_pid == job_handle->lastpid)){
+            if (WIFEXITED(sta)){fgstatus = WEXITSTATUS(sta);}
+            else if (WIFSIGNALED(sta)){fgstatus = 128 + WTERMSIG(sta);}
+            else if (WIFSTOPPED(sta)){fgstatus = 128 + WSTOPSIG(sta);}
         }
-        else if(WIFSTOPPED(sta)){
-            printf("Job [%d] (%d) stopped by signal 20\n", pid2jid(group_pid), group_pid);
-            fflush(stdout);
-            (*job_handle).state = ST; // Chnage state as job/process is now stopped and sent to the background processes.
+
+        // Whoever waits on the job, such as dag, hears how it ended
+        if (job_handle != NULL && job_handle->exitp != NULL
+                && group_pid == job_handle->lastpid && !WIFSTOPPED(sta)){
+            *job_handle->exitp = job_handle->timedout ? 124
+                : WIFEXITED(sta) ? WEXITSTATUS(sta) : 128 + WTERMSIG(sta);
+        }
+
+        // A job killed for running past its deadline ends with 124
+        if (job_handle != NULL && job_handle->timedout && !WIFSTOPPED(sta)){
+            if (job_handle->state != BG && group_pid == job_handle->lastpid){fgstatus = 124;}
+            if (job_handle->nprocs == 1){
+                printf("Job [%d] (%d) timed out\n", job_handle->jid, leader);}
+            deleteproc(jobs, group_pid);
+        }
+        else if(WIFSIGNALED(sta)){
+            // A stage that loses its reader to SIGPIPE is no news
+            if (group_pid == leader && WTERMSIG(sta) != SIGPIPE){
+                printf("Job [%d] (%d) terminated by signal 2\n",pid2jid(leader) ,leader);}
+            deleteproc(jobs, group_pid);
+        }   
+        else if(WIFEXITED(sta)){
+            deleteproc(jobs, group_pid); // Delete the job once it is now done and complete, no need for it to occupy space in the job list. 
+        }
+        else if(WIFSTOPPED(sta) && job_handle != NULL){
+            if (group_pid == leader){
+                printf("Job [%d] (%d) stopped by signal 20\n", pid2jid(leader), leader);
+                fflush(stdout);}
+            (*job_handle).state = ST; // Chnage state as job/process is now stopped and sent to the background processes.
         }
         // printf("572\n");
 
@@ -594,8 +1614,9 @@ void sigchld_handler(int sig) {
 void sigint_handler(int sig) {
     //kill(0, SIGINT);
     pid_t curr = fgpid(jobs);
+    intr = 1; // Stops a running loop as well as the foreground job
     if (curr != 0){
-        kill(-curr, SIGINT);
+        signaljob(getjobpid(jobs, curr), SIGINT);
     }
     return;
     }
@@ -610,7 +1631,7 @@ void sigtstp_handler(int sig) {
     pid_t curr = fgpid(jobs);
     if (curr != 0){ 
         getjobpid(jobs, curr)->state=ST;
-        kill(-curr, SIGTSTP);
+        signaljob(getjobpid(jobs, curr), SIGTSTP);
     }
     return;
 }
@@ -636,6 +1657,10 @@ void clearjob(struct job_t *job) {
     job->pid = 0;
     job->jid = 0;
     job->state = UNDEF;
+    job->nprocs = 0;
+    twcancel(&job->deadline);
+    job->timedout = 0;
+    job->exitp = NULL;
     job->cmdline[0] = '\0';
 }
 
@@ -676,6 +1701,12 @@ int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) {
             jobs[i].pid = pid;
             jobs[i].state = state;
             jobs[i].jid = free;
+            jobs[i].nprocs = 1;
+            jobs[i].procs[0] = pid;
+            jobs[i].lastpid = pid;
+            jobs[i].deadline.fire = jobexpired;
+            if (timeoutms > 0)
+                twarm(&jobs[i].deadline, timeoutms);
             strcpy(jobs[i].cmdline, cmdline);
             if(verbose){
                 printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
@@ -686,6 +1717,14 @@ int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) {
     return 0; /*suppress compiler warning*/
 }
 
+/* addproc - Add a further pipeline stage to a job; it becomes the last */
+void addproc(struct job_t *job, pid_t pid) {
+    if (job == NULL || job->nprocs == MAXPROCS)
+        return;
+    job->procs[job->nprocs++] = pid;
+    job->lastpid = pid;
+}
+
 /* deletejob - Delete a job whose PID=pid from the job list */
 int deletejob(struct job_t *jobs, pid_t pid) {
     int i;
@@ -702,6 +1741,34 @@ int deletejob(struct job_t *jobs, pid_t pid) {
     return 0;
 }
 
+/* deleteproc - Drop an exited process; its job goes with the last one */
+void deleteproc(struct job_t *jobs, pid_t pid) {
+    struct job_t *job = getjobproc(jobs, pid);
+    int i;
+
+    if (job == NULL)
+        return;
+    for (i = 0; job->procs[i] != pid; i++)
+        ;
+    job->procs[i] = job->procs[--job->nprocs];
+    if (job->nprocs == 0)
+        deletejob(jobs, job->pid);
+}
+
+/*
+ * signaljob - Send sig to every process of a job: to its process group,
+ *    or in a dag task, where jobs stay in the task's group, to each of
+ *    its processes in turn
+ */
+void signaljob(struct job_t *job, int sig) {
+    if (!nojobctl) {
+        kill(-job->pid, sig);
+        return;
+    }
+    for (int i = 0; i < job->nprocs; i++)
+        kill(job->procs[i], sig);
+}
+
 /* fgpid - Return PID of current foreground job, 0 if no such job */
 pid_t fgpid(struct job_t *jobs) {
     int i;
@@ -724,6 +1791,19 @@ struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
     return NULL;
 }
 
+/* getjobproc - Find the job a process (by PID) belongs to */
+struct job_t *getjobproc(struct job_t *jobs, pid_t pid) {
+    int i, j;
+
+    if (pid < 1)
+        return NULL;
+    for (i = 0; i < MAXJOBS; i++)
+        for (j = 0; j < jobs[i].nprocs; j++)
+            if (jobs[i].procs[j] == pid)
+                return &jobs[i];
+    return NULL;
+}
+
 /* getjobjid  - Find a job (by JID) on the job list */
 struct job_t *getjobjid(struct job_t *jobs, int jid) 
 {
@@ -753,6 +1833,7 @@ int pid2jid(pid_t pid) {
 /* listjobs - Print the job list */
 void listjobs(struct job_t *jobs) {
     int i;
+    long left;
     
     for (i = 0; i < MAXJOBS; i++) {
         if (jobs[i].pid != 0) {
@@ -771,6 +1852,10 @@ void listjobs(struct job_t *jobs) {
                     printf("listjobs: Internal error: job[%d].state=%d ", 
                        i, jobs[i].state);
             }
+            if (jobs[i].timedout)
+                printf("(timed out) ");
+            else if ((left = twleft(&jobs[i].deadline)) >= 0)
+                printf("(deadline in %lds) ", (left + 999) / 1000);
             printf("%s", jobs[i].cmdline);
         }
     }
@@ -780,35 +1865,2995 @@ void listjobs(struct job_t *jobs) {
  ******************************/
 
 
-/***********************
- * Other helper routines
- ***********************/
+/*************************************
+ * Deadline timer wheel
+ *************************************/
 
 /*
- * usage - print a help message and terminate
+ * Every deadline is an entry of one hierarchical timer wheel. Level l
+ * has 64 slots that are 64^l ms apart; an entry sits on the lowest
+ * level whose span covers its expiry, and is moved down a level each
+ * time the wheel reaches its slot, until it fires from level 0. So
+ * arming and cancelling are a list insert or unlink whatever the
+ * number of deadlines, and a bit per occupied slot finds the next
+ * time anything is due. A single timerfd is set for that time, and
+ * the shell runs the wheel whenever the timerfd is readable while it
+ * waits for input or for a foreground job.
  */
-void usage(void) {
-    printf("Usage: shell [-hvp]\n");
-    printf("   -h   print this message\n");
-    printf("   -v   print additional diagnostic information\n");
-    printf("   -p   do not emit a command prompt\n");
-    exit(1);
+
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_MASK  (TW_SLOTS - 1)
+#define TW_NEVER (~0ULL)
+
+/* clockms - CLOCK_MONOTONIC in ms */
+unsigned long long clockms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* twlink - Queue an entry in the slot its expiry falls into */
+void twlink(struct wtimer_t *t) {
+    unsigned long long delta = t->expires - wheel.now;
+    int level = 0;
+
+    if (delta >= 1ULL << (TW_BITS * TW_LEVELS)) { /* beyond the wheel */
+        delta = (1ULL << (TW_BITS * TW_LEVELS)) - 1;
+        t->expires = wheel.now + delta;
+    }
+    if (delta >= TW_SLOTS)
+        level = (63 - __builtin_clzll(delta)) / TW_BITS;
+    t->level = level;
+    t->slot = (t->expires >> (TW_BITS * level)) & TW_MASK;
+
+    struct wtimer_t **head = &wheel.slots[level][t->slot];
+    if ((t->next = *head) != NULL)
+        t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+    wheel.occupied[level] |= 1ULL << t->slot;
+}
+
+/* twunlink - Take an entry out of its slot */
+void twunlink(struct wtimer_t *t) {
+    if ((*t->pprev = t->next) != NULL)
+        t->next->pprev = t->pprev;
+    if (wheel.slots[t->level][t->slot] == NULL)
+        wheel.occupied[t->level] &= ~(1ULL << t->slot);
+    t->pprev = NULL;
 }
 
 /*
- * unix_error - unix-style error routine
+ * twnext - The next ms at which the wheel has work: a level 0 slot to
+ *    fire, or a slot on a higher level to move down
  */
-void unix_error(char *msg) {
-    fprintf(stdout, "%s: %s\n", msg, strerror(errno));
-    exit(1);
+unsigned long long twnext(void) {
+    unsigned long long next = TW_NEVER;
+
+    for (int l = 0; l < TW_LEVELS; l++) {
+        unsigned long long occ = wheel.occupied[l];
+        if (occ == 0)
+            continue;
+        int shift = TW_BITS * l;
+        unsigned long long base = wheel.now >> shift;
+        int from = (base + 1) & TW_MASK; /* rotate: bit 0 is the next slot */
+        unsigned long long rot = (occ >> from) | (from ? occ << (TW_SLOTS - from) : 0);
+        unsigned long long at = (base + 1 + __builtin_ctzll(rot)) << shift;
+        if (at < next)
+            next = at;
+    }
+    return next;
 }
 
 /*
- * app_error - application-style error routine
+ * twrun - Run the wheel up to ms target, moving entries down as their
+ *    slots come up and firing those that expire
  */
-void app_error(char *msg) {
-    fprintf(stdout, "%s\n", msg);
-    exit(1);
+void twrun(unsigned long long target) {
+    unsigned long long at;
+
+    while ((at = twnext()) <= target) {
+        wheel.now = at;
+        for (int l = TW_LEVELS - 1; l > 0; l--) {
+            if (at & ((1ULL << (TW_BITS * l)) - 1))
+                continue; /* not at a slot boundary of this level */
+            struct wtimer_t **head = &wheel.slots[l][(at >> (TW_BITS * l)) & TW_MASK];
+            while (*head != NULL) {
+                struct wtimer_t *t = *head;
+                twunlink(t);
+                twlink(t);
+            }
+        }
+        struct wtimer_t **head = &wheel.slots[0][at & TW_MASK];
+        while (*head != NULL) {
+            struct wtimer_t *t = *head;
+            twunlink(t);
+            wheel.count--;
+            t->fire(t);
+        }
+    }
+    if (target > wheel.now)
+        wheel.now = target;
+}
+
+/* twschedule - Set the timerfd for the next work if that is sooner */
+void twschedule(void) {
+    unsigned long long next = twnext();
+    struct itimerspec its = {{0, 0}, {0, 0}};
+
+    if (next >= wheel.armedfor)
+        return;
+    if (wheel.fd < 0
+            && (wheel.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        unix_error("timerfd_create error");
+    its.it_value.tv_sec = next / 1000;
+    its.it_value.tv_nsec = next % 1000 * 1000000;
+    if (timerfd_settime(wheel.fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        unix_error("timerfd_settime error");
+    wheel.armedfor = next;
+}
+
+/*
+ * twarm - Arm t to fire ms from now, replacing any earlier expiry.
+ *    The caller blocks SIGCHLD, whose handler cancels job deadlines.
+ */
+void twarm(struct wtimer_t *t, long ms) {
+    unsigned long long now = clockms();
+
+    twcancel(t);
+    if (wheel.count == 0) { /* nothing to run up to: restart from now */
+        wheel.now = now;
+        wheel.armedfor = TW_NEVER;
+    }
+    t->expires = now + ms > wheel.now ? now + ms : wheel.now + 1;
+    twlink(t);
+    wheel.count++;
+    twschedule();
+}
+
+/* twcancel - Disarm t if it is armed */
+void twcancel(struct wtimer_t *t) {
+    if (t->pprev == NULL)
+        return;
+    twunlink(t);
+    wheel.count--;
+}
+
+/*
+ * twexpire - Fire what is due once the timerfd is readable. The caller
+ *    blocks SIGCHLD.
+ */
+void twexpire(void) {
+    unsigned long long n;
+
+    if (read(wheel.fd, &n, sizeof(n)) < 0 && errno == EAGAIN)
+        return;
+    wheel.armedfor = TW_NEVER;
+    twrun(clockms());
+    if (wheel.count > 0)
+        twschedule();
+}
+
+/*
+ * twreset - Empty the wheel in a forked subshell, whose deadlines are
+ *    its own; the timerfd is shared with the parent until replaced.
+ */
+void twreset(void) {
+    for (int l = 0; l < TW_LEVELS; l++)
+        for (int i = 0; i < TW_SLOTS; i++)
+            while (wheel.slots[l][i] != NULL)
+                twunlink(wheel.slots[l][i]);
+    if (wheel.fd >= 0)
+        close(wheel.fd);
+    wheel.fd = -1;
+    wheel.count = 0;
+    wheel.armedfor = TW_NEVER;
+}
+
+/* twleft - ms until t fires, -1 if it is not armed */
+long twleft(struct wtimer_t *t) {
+    unsigned long long now = clockms();
+
+    if (t->pprev == NULL)
+        return -1;
+    return t->expires > now ? (long)(t->expires - now) : 0;
+}
+
+/*
+ * twwait - sigsuspend(mask) for a caller that blocks SIGCHLD, which
+ *    also returns after running the wheel if a deadline is due
+ */
+void twwait(sigset_t *mask) {
+    struct pollfd pfd = {wheel.fd, POLLIN, 0};
+
+    if (wheel.fd < 0) {
+        sigsuspend(mask);
+        return;
+    }
+    if (ppoll(&pfd, 1, NULL, mask) > 0)
+        twexpire();
+}
+
+/*
+ * parseduration - Parse a DURATION: a number of seconds, possibly with
+ *    a fraction, and an optional s, m, h or d suffix. Returns ms, or
+ *    -1 if s is no duration.
+ */
+long parseduration(const char *s) {
+    char *end;
+    double d = strtod(s, &end);
+
+    if (end == s || !(d >= 0))
+        return -1;
+    if (*end == 'm')
+        d *= 60;
+    else if (*end == 'h')
+        d *= 3600;
+    else if (*end == 'd')
+        d *= 86400;
+    else if (*end != 's' && *end != '\0')
+        return -1;
+    if (*end != '\0' && end[1] != '\0')
+        return -1;
+    d *= 1000;
+    return d < LONG_MAX ? (long)d : LONG_MAX;
+}
+
+/*
+ * jobexpired - A job ran past its deadline: ask its processes to
+ *    terminate, and kill it outright if it is still there KILLGRACE ms
+ *    later. Its status becomes 124, as with timeout(1).
+ */
+void jobexpired(struct wtimer_t *t) {
+    struct job_t *job = (struct job_t *)((char *)t - offsetof(struct job_t, deadline));
+
+    if (job->timedout == 0) {
+        job->timedout = 1;
+        signaljob(job, SIGTERM);
+        signaljob(job, SIGCONT); /* a stopped job must see it too */
+        twarm(t, KILLGRACE);
+    }
+    else {
+        job->timedout = 2;
+        signaljob(job, SIGKILL);
+    }
+}
+
+
+/*************************************
+ * Per-command arena
+ *************************************/
+
+/*
+ * Everything a command line needs while it is compiled and run comes
+ * from one fixed mapping: tokens, compiled nodes and words, expanded
+ * strings, argv vectors and pipeline stage descriptors. Allocation is
+ * a pointer bump; eval drops the lot in O(1) once the line is done, and
+ * each simple command drops its expansions the same way. The mapping
+ * never grows. A line whose compiled form does not fit is refused, and
+ * an expansion too big for what is left, such as a large $(...)
+ * capture, goes to the heap and is freed with the command.
+ */
+
+/* aalloc - n bytes from the arena, 16-byte aligned; NULL if full */
+void *aalloc(size_t n) {
+    size_t at = (arena.used + 15) & ~(size_t)15;
+
+    if (arena.base == NULL) {
+        void *p = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED)
+            unix_error("mmap error");
+        arena.base = p;
+    }
+    if (at > ARENA_SIZE || n > ARENA_SIZE - at)
+        return NULL;
+    arena.used = at + n;
+    if (arena.used > arena.high)
+        arena.high = arena.used;
+    return arena.base + at;
+}
+
+/* 
+ * agrow - Resize the old bytes at p to n. The last block in the arena
+ *    grows in place; anything else, arena or not, is copied to a new
+ *    block. NULL if the arena is full.
+ */
+void *agrow(void *p, size_t old, size_t n) {
+    char *q = p;
+
+    if (q != NULL && q + old == arena.base + arena.used
+            && n - old <= ARENA_SIZE - arena.used) {
+        arena.used += n - old;
+        if (arena.used > arena.high)
+            arena.high = arena.used;
+        return p;
+    }
+    if ((q = aalloc(n)) != NULL && old > 0)
+        memcpy(q, p, old);
+    return q;
+}
+
+/*
+ * aspill - n bytes on the heap for a block too big to belong in the
+ *    arena, freed by the arelease that frees what comes before it. A
+ *    stub taken from the arena keeps later marks past it. NULL if the
+ *    arena is full.
+ */
+void *aspill(size_t n) {
+    size_t at = arena.used;
+    struct spill_t *s;
+
+    if (aalloc(1) == NULL)
+        return NULL;
+    s = Malloc(sizeof(struct spill_t) + n);
+    s->at = at;
+    s->next = arena.spill;
+    arena.spill = s;
+    return s + 1;
+}
+
+/* amark - Where the arena is now, to be handed back to arelease */
+size_t amark(void) {
+    return arena.used;
+}
+
+/* arelease - Free everything allocated since mark */
+void arelease(size_t mark) {
+    while (arena.spill != NULL && arena.spill->at >= mark) {
+        struct spill_t *s = arena.spill;
+        arena.spill = s->next;
+        free(s);
+    }
+    arena.used = mark;
+}
+
+/* inarena - Is p arena storage (rather than heap or stack)? */
+int inarena(const void *p) {
+    return arena.base != NULL && (const char *)p >= arena.base
+        && (const char *)p < arena.base + ARENA_SIZE;
+}
+
+/* 
+ * cmalloc - Compiler storage: the heap inside a function body, which
+ *    the function table keeps, else the arena. A full arena abandons
+ *    the compile.
+ */
+void *cmalloc(size_t n) {
+    void *p;
+
+    if (arena.persist)
+        return Malloc(n);
+    if ((p = aalloc(n)) == NULL)
+        longjmp(*arena.full, 1);
+    return p;
+}
+
+/* crealloc - Resize compiler storage from cmalloc */
+void *crealloc(void *p, size_t old, size_t n) {
+    if (arena.persist)
+        return Realloc(p, n);
+    if ((p = agrow(p, old, n)) == NULL)
+        longjmp(*arena.full, 1);
+    return p;
+}
+
+/* cfree - Free compiler storage from cmalloc */
+void cfree(void *p) {
+    if (arena.persist)
+        free(p);
+}
+
+/*
+ * csavestr - NUL-terminated copy of s[0..len) in compiler storage. A
+ *    literal of SPILL_MIN or more, such as a large here-document body,
+ *    is spilled to the heap rather than filling the arena.
+ */
+char *csavestr(const char *s, int len) {
+    char *p;
+
+    if (arena.persist || len + 1 < SPILL_MIN)
+        p = cmalloc(len + 1);
+    else if ((p = aspill(len + 1)) == NULL)
+        longjmp(*arena.full, 1);
+
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+/* ctemp - Grow scratch space that is only needed during the compile */
+void *ctemp(void *p, size_t old, size_t n) {
+    if ((p = agrow(p, old, n)) == NULL)
+        longjmp(*arena.full, 1);
+    return p;
+}
+/*************************************
+ * end per-command arena
+ *************************************/
+
+
+/*************************************
+ * Script compiler and interpreter
+ *************************************/
+
+/*
+ * A command line is compiled once into a list of nodes. Words are
+ * split into literal and expansion segments, variables are resolved
+ * to their table entries and $((expr)) becomes a small postfix
+ * program, so running a loop body only expands words and dispatches.
+ */
+
+/* Script tokens */
+#define T_WORD 0  /* word */
+#define T_SEP  1  /* ; or newline */
+#define T_EOF  2  /* end of text */
+#define T_AND  3  /* && */
+#define T_OR   4  /* || */
+#define T_ERR  5  /* text the lexer cannot take: a syntax error */
+
+struct tok_t {
+    int type;               /* T_WORD, T_SEP, T_EOF, T_AND or T_OR */
+    int quoted;             /* word was enclosed in single quotes */
+    int heredoc;            /* here-document body (the delimiter until read) */
+    const char *s;          /* token text */
+    int len;
+};
+
+struct parser_t {
+    struct tok_t *tok;      /* token array, ends with T_EOF */
+    int pos;                /* current token */
+    int more;               /* text ended inside an open construct */
+    struct tok_t *err;      /* token of the first syntax error */
+};
+
+/* Compile results */
+#define C_OK    0
+#define C_ERR   1
+#define C_MORE -1
+
+/* hashstr - Hash len bytes of a name for the variable and function tables */
+unsigned hashstr(const char *s, int len) {
+    unsigned h = 5381;
+
+    for (int i = 0; i < len; i++)
+        h = h * 33 + (unsigned char)s[i];
+    return h % VARHASH;
+}
+
+/* lookupvar - Find variable name[0..len), adding it unset if it is new */
+struct var_t *lookupvar(const char *name, int len) {
+    unsigned h = hashstr(name, len);
+    struct var_t *v;
+
+    for (v = vars[h]; v != NULL; v = v->next)
+        if (strncmp(v->name, name, len) == 0 && v->name[len] == '\0')
+            return v;
+    v = Malloc(sizeof(struct var_t));
+    v->name = savestr(name, len);
+    v->value = NULL;
+    v->cap = 0;
+    v->next = vars[h];
+    vars[h] = v;
+    return v;
+}
+
+/* setvar - Assign a copy of value to v, reusing its buffer when it fits */
+void setvar(struct var_t *v, const char *value) {
+    size_t n = strlen(value) + 1;
+
+    if (n > v->cap) {
+        v->cap = n < 16 ? 16 : n;
+        v->value = Realloc(v->value, v->cap);
+    }
+    memcpy(v->value, value, n);
+}
+
+/* findfunc - Find a shell function by name */
+struct func_t *findfunc(const char *name) {
+    struct func_t *f;
+
+    for (f = funcs[hashstr(name, strlen(name))]; f != NULL; f = f->next)
+        if (strcmp(f->name, name) == 0)
+            return f;
+    return NULL;
+}
+
+/* definefunc - Add or replace a shell function; the table owns body */
+void definefunc(const char *name, struct node_t *body) {
+    struct func_t *f = findfunc(name);
+
+    if (f == NULL) {
+        unsigned h = hashstr(name, strlen(name));
+        f = Malloc(sizeof(struct func_t));
+        f->name = savestr(name, strlen(name));
+        f->body = NULL;
+        f->next = funcs[h];
+        funcs[h] = f;
+        funcgen++; /* it may shadow a builtin some $(...) runs in-shell */
+    }
+    else if (funcdepth == 0) {
+        freenode(f->body); /* a running function keeps its old body */
+    }
+    f->body = body;
+}
+
+/* isname - Is s[0..len) a valid variable name? */
+int isname(const char *s, int len) {
+    if (len == 0 || !(isalpha((unsigned char)s[0]) || s[0] == '_'))
+        return 0;
+    for (int i = 1; i < len; i++)
+        if (!(isalnum((unsigned char)s[i]) || s[i] == '_'))
+            return 0;
+    return 1;
+}
+
+/* andor - T_AND or T_OR if p starts with && or ||, else 0 */
+int andor(const char *p) {
+    if (p[0] == '&' && p[1] == '&')
+        return T_AND;
+    if (p[0] == '|' && p[1] == '|')
+        return T_OR;
+    return 0;
+}
+
+/* 
+ * lexscript - Split script text into words, separators and && or ||.
+ *    Single quotes at the start of a word, as in parseline, make it
+ *    literal; $(...) and $((...)) may contain blanks. # starts a comment.
+ *    <<DELIM is followed by a token holding the here-document body,
+ *    taken from the lines after the current one. Sets *more if the
+ *    text ends before a body's delimiter line, leaving the delimiter
+ *    in heredoc.
+ */
+struct tok_t *lexscript(const char *p, int *more) {
+    int n = 0, cap = 64;
+    struct tok_t *tok = ctemp(NULL, 0, cap * sizeof(struct tok_t));
+    int pending[MAXARGS];   /* body tokens waiting for the next newline */
+    int npending = 0;
+    int wantdelim = 0;      /* the next word is a here-document delimiter */
+
+    *more = 0;
+    while (1) {
+        if (n + 1 >= cap) {
+            tok = ctemp(tok, cap * sizeof(struct tok_t),
+                        2 * cap * sizeof(struct tok_t));
+            cap *= 2;
+        }
+        struct tok_t *t = &tok[n++];
+        t->quoted = 0;
+        t->heredoc = 0;
+        t->len = 0;
+
+        while (*p == ' ' || *p == '\t' || *p == '\r')
+            p++;
+        t->s = p;
+
+        if (*p == '#') { /* comment: the separator is where it began */
+            while (*p && *p != '\n')
+                p++;
+        }
+        if (*p == '\0') {
+            t->type = T_EOF;
+            if (npending > 0) {
+                *more = 1;
+                snprintf(heredoc, MAXLINE, "%.*s\n", tok[pending[0]].len,
+                         tok[pending[0]].s);
+            }
+            return tok;
+        }
+        if (*p == '\n' || *p == ';') {
+            t->type = T_SEP;
+            t->len = 1;
+            wantdelim = 0; /* << with no delimiter fails when it runs */
+            if (*p++ == ';' || npending == 0)
+                continue;
+
+            /* Bodies of the here-documents opened on this line */
+            for (int i = 0; i < npending; i++) {
+                struct tok_t *d = &tok[pending[i]];
+                const char *body = p, *e;
+                while (1) {
+                    if ((e = strchr(p, '\n')) == NULL) {
+                        *more = 1;
+                        snprintf(heredoc, MAXLINE, "%.*s\n", d->len, d->s);
+                        tok[n].type = T_EOF;
+                        tok[n].quoted = tok[n].heredoc = tok[n].len = 0;
+                        tok[n].s = p + strlen(p);
+                        return tok;
+                    }
+                    if (e - p == d->len && strncmp(p, d->s, d->len) == 0)
+                        break;
+                    p = e + 1;
+                }
+                d->s = body;
+                d->len = p - body;
+                p = e + 1;
+            }
+            npending = 0;
+            continue;
+        }
+        if ((t->type = andor(p)) != 0) {
+            t->len = 2;
+            p += 2;
+            continue;
+        }
+
+        t->type = T_WORD;
+        if (*p == '\'') {
+            const char *end = strchr(p + 1, '\'');
+            if (end == NULL) /* unterminated: runs to the end of line */
+                for (end = p + 1; *end && *end != '\n'; end++)
+                    ;
+            t->quoted = 1;
+            t->s = p + 1;
+            t->len = end - t->s;
+            p = *end == '\'' ? end + 1 : end;
+        }
+        else {
+            int depth = 0;
+            while (*p && (depth > 0 || (!strchr(" \t\r\n;", *p) && !andor(p)))) {
+                if (depth > 0 && *p == '\'' && strchr(p + 1, '\'')) {
+                    p = strchr(p + 1, '\'') + 1; /* quoted text inside $(...) */
+                    continue;
+                }
+                if (p[0] == '$' && p[1] == '(') {
+                    depth++;
+                    p++;
+                }
+                else if (depth > 0 && *p == '(')
+                    depth++;
+                else if (depth > 0 && *p == ')')
+                    depth--;
+                p++;
+            }
+            t->len = p - t->s;
+
+            /* <<<word and <<DELIM are two tokens */
+            int op = strncmp(t->s, "<<<", 3) == 0 ? 3
+                   : strncmp(t->s, "<<", 2) == 0 ? 2 : 0;
+            if (op && !wantdelim) {
+                if (t->len > op) {
+                    t->len = op;
+                    p = t->s + op;
+                }
+                wantdelim = op == 2;
+                continue;
+            }
+        }
+
+        if (wantdelim) { /* becomes the body once the line is read */
+            if (npending == MAXARGS) { /* too many: fail at this << */
+                tok[n - 2].type = T_ERR;
+                t->type = T_EOF;
+                t->len = 0;
+                return tok;
+            }
+            t->heredoc = 1;
+            pending[npending++] = n - 1;
+            wantdelim = 0;
+        }
+    }
+}
+
+/* Token helpers */
+struct tok_t *cur(struct parser_t *ps) {
+    return &ps->tok[ps->pos];
+}
+
+/* iskw - Is the current token the unquoted reserved word kw? */
+int iskw(struct parser_t *ps, const char *kw) {
+    struct tok_t *t = cur(ps);
+    return t->type == T_WORD && !t->quoted && (int)strlen(kw) == t->len
+        && strncmp(t->s, kw, t->len) == 0;
+}
+
+void skipseps(struct parser_t *ps) {
+    while (cur(ps)->type == T_SEP)
+        ps->pos++;
+}
+
+/* syntax - Record the first syntax error, or a need for more input at EOF */
+void syntax(struct parser_t *ps) {
+    if (cur(ps)->type == T_EOF)
+        ps->more = 1;
+    else if (ps->err == NULL)
+        ps->err = cur(ps);
+}
+
+/* expect - Consume reserved word kw after optional separators */
+int expect(struct parser_t *ps, const char *kw) {
+    skipseps(ps);
+    if (!iskw(ps, kw)) {
+        syntax(ps);
+        return 0;
+    }
+    ps->pos++;
+    return 1;
+}
+
+int failed(struct parser_t *ps) {
+    return ps->more || ps->err != NULL;
+}
+
+/*
+ * Arithmetic: recursive descent over the text of $((expr)), emitting
+ * postfix ops. Precedence from low to high: || && == != < <= > >=
+ * + - * / % and unary - ! +.
+ */
+struct arith_t {
+    const char *p;          /* next character */
+    struct aop_t *ops;
+    int nops, cap;
+    int err;
+};
+
+void aemit(struct arith_t *a, int op, long num, struct var_t *var) {
+    if (a->nops == a->cap) {
+        int cap = a->cap ? 2 * a->cap : 8;
+        a->ops = crealloc(a->ops, a->cap * sizeof(struct aop_t),
+                          cap * sizeof(struct aop_t));
+        a->cap = cap;
+    }
+    a->ops[a->nops].op = op;
+    a->ops[a->nops].num = num;
+    a->ops[a->nops].var = var;
+    a->nops++;
+}
+
+/* amatch - Skip blanks and consume the operator s if it comes next */
+int amatch(struct arith_t *a, const char *s) {
+    int n = strlen(s);
+
+    while (isspace((unsigned char)*a->p))
+        a->p++;
+    if (strncmp(a->p, s, n) != 0)
+        return 0;
+    /* don't take < out of <=, = out of ==, & out of && */
+    if (n == 1 && (a->p[1] == '=' || a->p[1] == *s) && strchr("<>!=&|", *s))
+        return 0;
+    a->p += n;
+    return 1;
+}
+
+void aexpr(struct arith_t *a, int level);
+
+void aprimary(struct arith_t *a) {
+    while (isspace((unsigned char)*a->p))
+        a->p++;
+    if (amatch(a, "-")) {
+        aprimary(a);
+        aemit(a, A_NEG, 0, NULL);
+    }
+    else if (amatch(a, "!")) {
+        aprimary(a);
+        aemit(a, A_NOT, 0, NULL);
+    }
+    else if (amatch(a, "+")) {
+        aprimary(a);
+    }
+    else if (amatch(a, "(")) {
+        aexpr(a, 0);
+        if (!amatch(a, ")"))
+            a->err = 1;
+    }
+    else if (isdigit((unsigned char)*a->p)) {
+        char *end;
+        aemit(a, A_NUM, strtol(a->p, &end, 0), NULL);
+        a->p = end;
+    }
+    else {
+        if (*a->p == '$')
+            a->p++;
+        if (isdigit((unsigned char)*a->p)) {
+            aemit(a, A_ARG, *a->p - '0', NULL);
+            a->p++;
+            return;
+        }
+        const char *s = a->p;
+        while (isalnum((unsigned char)*a->p) || *a->p == '_')
+            a->p++;
+        if (!isname(s, a->p - s))
+            a->err = 1;
+        else
+            aemit(a, A_VAR, 0, lookupvar(s, a->p - s));
+    }
+}
+
+/* aexpr - Parse binary operators of precedence level and above */
+void aexpr(struct arith_t *a, int level) {
+    static const char *opname[] = {"||", "&&", "==", "!=", "<=", ">=",
+        "<", ">", "+", "-", "*", "/", "%", NULL};
+    static const int oplevel[] = {0, 1, 2, 2, 3, 3, 3, 3, 4, 4, 5, 5, 5};
+    static const int opcode[] = {A_OR, A_AND, A_EQ, A_NE, A_LE, A_GE,
+        A_LT, A_GT, A_ADD, A_SUB, A_MUL, A_DIV, A_MOD};
+    int i;
+
+    if (level > 5) {
+        aprimary(a);
+        return;
+    }
+    aexpr(a, level + 1);
+    while (!a->err) {
+        for (i = 0; opname[i] != NULL; i++)
+            if (oplevel[i] == level && amatch(a, opname[i]))
+                break;
+        if (opname[i] == NULL)
+            return;
+        aexpr(a, level + 1);
+        aemit(a, opcode[i], 0, NULL);
+    }
+}
+
+/*
+ * evalarith - Run a compiled $((expr)). Division by zero gives 0, and
+ *    so does LONG_MIN % -1; LONG_MIN / -1, like *, + and -, wraps.
+ */
+long evalarith(struct aop_t *ops, int nops) {
+    long st[nops];
+    int sp = 0;
+
+    for (int i = 0; i < nops; i++) {
+        struct aop_t *o = &ops[i];
+        long y = sp > 0 ? st[sp - 1] : 0;
+        switch (o->op) {
+            case A_NUM: st[sp++] = o->num; continue;
+            case A_VAR: st[sp++] = o->var->value ? strtol(o->var->value, NULL, 10) : 0; continue;
+            case A_ARG: st[sp++] = o->num <= posc && posv ? strtol(posv[o->num], NULL, 10) : 0; continue;
+            case A_NEG: st[sp - 1] = -(unsigned long)y; continue;
+            case A_NOT: st[sp - 1] = !y; continue;
+        }
+        long x = st[sp - 2];
+        sp--;
+        switch (o->op) {
+            case A_MUL: x = (unsigned long)x * y; break;
+            case A_DIV: x = y == -1 ? -(unsigned long)x : y ? x / y : 0; break;
+            case A_MOD: x = y == -1 || y == 0 ? 0 : x % y; break;
+            case A_ADD: x = (unsigned long)x + y; break;
+            case A_SUB: x = (unsigned long)x - y; break;
+            case A_LT:  x = x < y; break;
+            case A_LE:  x = x <= y; break;
+            case A_GT:  x = x > y; break;
+            case A_GE:  x = x >= y; break;
+            case A_EQ:  x = x == y; break;
+            case A_NE:  x = x != y; break;
+            case A_AND: x = x && y; break;
+            case A_OR:  x = x || y; break;
+        }
+        st[sp - 1] = x;
+    }
+    return sp > 0 ? st[sp - 1] : 0;
+}
+
+struct node_t *parselist(struct parser_t *ps, const char **stops);
+struct node_t *parsecmd(struct parser_t *ps);
+
+/* 
+ * inprocok - Can a $(...) list run inside the shell? Only if it is made
+ *    of output-only builtins and if/while/until/{ } around them: no
+ *    programs, pipes, redirections, assignments or loop control.
+ */
+int inprocok(struct node_t *n) {
+    static const char *ok[] = {"true", "false", ":", "echo", "test", "[",
+        "jobs", NULL};
+
+    for (; n != NULL; n = n->next) {
+        switch (n->type) {
+            case N_CMD: {
+                int i, found = 0;
+                if (n->nwords == 0 || n->words[0].assign || n->words[0].segs)
+                    return 0;
+                for (i = 0; ok[i] != NULL; i++)
+                    found |= strcmp(n->words[0].lit, ok[i]) == 0;
+                if (!found || findfunc(n->words[0].lit) != NULL)
+                    return 0;
+                for (i = 1; i < n->nwords; i++)
+                    if (n->words[i].lit && strchr("|<>&", n->words[i].lit[0])
+                            && strlen(n->words[i].lit) == 1)
+                        return 0;
+                break;
+            }
+            case N_IF:
+            case N_WHILE:
+            case N_UNTIL:
+            case N_GROUP:
+            case N_AND:
+            case N_OR:
+                if (!inprocok(n->cond) || !inprocok(n->body) || !inprocok(n->alt))
+                    return 0;
+                break;
+            default:
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/* addseg - Append a segment to a word being compiled */
+struct seg_t *addseg(struct word_t *w, int type) {
+    w->segs = crealloc(w->segs, w->nsegs * sizeof(struct seg_t),
+                       (w->nsegs + 1) * sizeof(struct seg_t));
+    struct seg_t *g = &w->segs[w->nsegs++];
+    memset(g, 0, sizeof(struct seg_t));
+    g->type = type;
+    return g;
+}
+
+/* 
+ * compileword - Compile the text of token t into w. Returns 0, or -1
+ *    on a malformed $((expr)).
+ */
+int compileword(struct tok_t *t, struct word_t *w, int assignok) {
+    const char *p = t->s, *end = t->s + t->len;
+    const char *eq;
+
+    memset(w, 0, sizeof(struct word_t));
+    if (t->quoted || memchr(p, '$', t->len) == NULL) {
+        w->lit = csavestr(p, t->len);
+        if (!t->quoted && assignok && (eq = memchr(p, '=', t->len)) != NULL
+                && isname(p, eq - p)) {
+            w->assign = lookupvar(p, eq - p);
+            memmove(w->lit, w->lit + (eq - p) + 1, end - eq);
+        }
+        return 0;
+    }
+
+    if (assignok && (eq = memchr(p, '=', t->len)) != NULL && isname(p, eq - p)) {
+        w->assign = lookupvar(p, eq - p);
+        p = eq + 1;
+    }
+    while (p < end) {
+        const char *q = p;
+        if (*p != '$') {
+            while (q < end && *q != '$')
+                q++;
+        }
+        else if (p + 2 < end && p[1] == '(' && p[2] == '(') {
+            /* $((expr)): the lexer kept the parentheses balanced */
+            int depth = 0;
+            for (q = p + 1; q < end; q++) {
+                if (*q == '(') depth++;
+                else if (*q == ')' && --depth == 0) break;
+            }
+            if (q >= end || q[-1] != ')')
+                return -1;
+            struct arith_t a = {0};
+            int elen = q - 1 - (p + 3);
+            char *expr = ctemp(NULL, 0, elen + 1);
+            memcpy(expr, p + 3, elen);
+            expr[elen] = '\0';
+            a.p = expr;
+            aexpr(&a, 0);
+            while (isspace((unsigned char)*a.p))
+                a.p++;
+            if (a.err || *a.p != '\0' || a.nops == 0) {
+                cfree(a.ops);
+                return -1;
+            }
+            struct seg_t *g = addseg(w, S_ARITH);
+            g->ops = a.ops;
+            g->nops = a.nops;
+            p = q + 1;
+            continue;
+        }
+        else if (p + 1 < end && p[1] == '(') {
+            /* $(list): compiled now, run each time the word is expanded */
+            int depth = 0;
+            for (q = p + 1; q < end; q++) {
+                if (*q == '\'' && memchr(q + 1, '\'', end - q - 1))
+                    q = memchr(q + 1, '\'', end - q - 1);
+                else if (*q == '(') depth++;
+                else if (*q == ')' && --depth == 0) break;
+            }
+            if (q >= end)
+                return -1;
+            struct parser_t sp = {0};
+            int tlen = q - (p + 2);
+            char *text = ctemp(NULL, 0, tlen + 1);
+            memcpy(text, p + 2, tlen);
+            text[tlen] = '\0';
+            int more;
+            sp.tok = lexscript(text, &more);
+            struct node_t *prog = parselist(&sp, NULL);
+            if (failed(&sp) || more) {
+                if (arena.persist)
+                    freenode(prog);
+                else
+                    dropfuncs(prog);
+                return -1;
+            }
+            struct seg_t *g = addseg(w, S_CMDSUB);
+            g->prog = prog;
+            g->inproc = inprocok(prog);
+            g->fgen = funcgen;
+            w->split = !w->assign;
+            p = q + 1;
+            continue;
+        }
+        else if (p + 1 < end && p[1] == '{') {
+            for (q = p + 2; q < end && *q != '}'; q++)
+                ;
+            if (q < end && isname(p + 2, q - (p + 2))) {
+                addseg(w, S_VAR)->var = lookupvar(p + 2, q - (p + 2));
+                p = q + 1;
+                continue;
+            }
+            q = p + 1;
+        }
+        else if (p + 1 < end && (isalpha((unsigned char)p[1]) || p[1] == '_')) {
+            for (q = p + 2; q < end && (isalnum((unsigned char)*q) || *q == '_'); q++)
+                ;
+            addseg(w, S_VAR)->var = lookupvar(p + 1, q - (p + 1));
+            p = q;
+            continue;
+        }
+        else if (p + 1 < end && isdigit((unsigned char)p[1])) {
+            addseg(w, S_ARG)->arg = p[1] - '0';
+            p += 2;
+            continue;
+        }
+        else if (p + 1 < end && (p[1] == '#' || p[1] == '?' || p[1] == '@')) {
+            addseg(w, p[1] == '#' ? S_NARGS : p[1] == '?' ? S_STATUS : S_ALL);
+            p += 2;
+            continue;
+        }
+        else {
+            q = p + 1; /* a lone $ is literal */
+            while (q < end && *q != '$')
+                q++;
+        }
+        struct seg_t *g = addseg(w, S_LIT);
+        g->lit = csavestr(p, q - p);
+        g->len = q - p;
+        p = q;
+    }
+    if (w->nsegs == 0) /* NAME= with nothing after it */
+        w->lit = csavestr("", 0);
+    return 0;
+}
+
+/* newnode - Allocate an empty node of the given type */
+struct node_t *newnode(int type) {
+    struct node_t *n = cmalloc(sizeof(struct node_t));
+    memset(n, 0, sizeof(struct node_t));
+    n->type = type;
+    return n;
+}
+
+/* compilewords - Compile tokens up to the next separator into n->words */
+void compilewords(struct parser_t *ps, struct node_t *n, int assignok) {
+    int start = ps->pos;
+
+    while (cur(ps)->type == T_WORD)
+        ps->pos++;
+    n->words = cmalloc((ps->pos - start + 1) * sizeof(struct word_t));
+    for (int i = start; i < ps->pos; i++) {
+        struct word_t *w = &n->words[n->nwords++];
+        if (compileword(&ps->tok[i], w, assignok) < 0) {
+            ps->err = &ps->tok[i];
+            return;
+        }
+        if (ps->tok[i].heredoc || (i > start && !ps->tok[i - 1].quoted
+                && ps->tok[i - 1].len == 3 && strncmp(ps->tok[i - 1].s, "<<<", 3) == 0))
+            w->split = 0; /* here-document and here-string text stays whole */
+        assignok = assignok && w->assign != NULL;
+    }
+}
+
+/* parsesimple - A command's words; its text runs to the separator */
+struct node_t *parsesimple(struct parser_t *ps) {
+    struct node_t *n = newnode(N_CMD);
+    const char *s = cur(ps)->s;
+
+    compilewords(ps, n, 1);
+    int len = cur(ps)->s - s;
+    if (len > MAXLINE - 2)
+        len = MAXLINE - 2;
+    n->text = cmalloc(len + 2);
+    memcpy(n->text, s, len);
+    n->text[len] = '\n';
+    n->text[len + 1] = '\0';
+    return n;
+}
+
+/* parseif - if list; then list; [elif ...] [else list;] fi */
+struct node_t *parseif(struct parser_t *ps) {
+    static const char *thenstop[] = {"then", NULL};
+    static const char *ifstop[] = {"elif", "else", "fi", NULL};
+    static const char *fistop[] = {"fi", NULL};
+    struct node_t *n = newnode(N_IF);
+
+    ps->pos++;
+    n->cond = parselist(ps, thenstop);
+    if (failed(ps) || !expect(ps, "then"))
+        return n;
+    n->body = parselist(ps, ifstop);
+    if (failed(ps))
+        return n;
+    if (iskw(ps, "elif")) {
+        n->alt = parseif(ps); /* consumes the closing fi */
+        return n;
+    }
+    if (iskw(ps, "else")) {
+        ps->pos++;
+        n->alt = parselist(ps, fistop);
+        if (failed(ps))
+            return n;
+    }
+    expect(ps, "fi");
+    return n;
+}
+
+/* parseloop - while/until list; do list; done */
+struct node_t *parseloop(struct parser_t *ps) {
+    static const char *dostop[] = {"do", NULL};
+    static const char *donestop[] = {"done", NULL};
+    struct node_t *n = newnode(iskw(ps, "while") ? N_WHILE : N_UNTIL);
+
+    ps->pos++;
+    n->cond = parselist(ps, dostop);
+    if (failed(ps) || !expect(ps, "do"))
+        return n;
+    n->body = parselist(ps, donestop);
+    if (!failed(ps))
+        expect(ps, "done");
+    return n;
+}
+
+/* parsefor - for name [in words]; do list; done */
+struct node_t *parsefor(struct parser_t *ps) {
+    static const char *donestop[] = {"done", NULL};
+    struct node_t *n = newnode(N_FOR);
+    struct tok_t *t;
+
+    ps->pos++;
+    t = cur(ps);
+    if (t->type != T_WORD || t->quoted || !isname(t->s, t->len)) {
+        syntax(ps);
+        return n;
+    }
+    n->var = lookupvar(t->s, t->len);
+    ps->pos++;
+    if (iskw(ps, "in")) {
+        ps->pos++;
+        compilewords(ps, n, 0);
+        if (failed(ps))
+            return n;
+    }
+    else {
+        n->nwords = -1; /* iterate over "$@" */
+    }
+    if (!expect(ps, "do"))
+        return n;
+    n->body = parselist(ps, donestop);
+    if (!failed(ps))
+        expect(ps, "done");
+    return n;
+}
+
+/* parsefunc - name() command, or function name command */
+struct node_t *parsefunc(struct parser_t *ps) {
+    struct node_t *n = newnode(N_FUNC);
+    struct tok_t *t = cur(ps);
+    int len = t->len;
+
+    if (iskw(ps, "function")) {
+        ps->pos++;
+        t = cur(ps);
+        len = t->len;
+        if (len > 2 && strncmp(t->s + len - 2, "()", 2) == 0)
+            len -= 2;
+    }
+    else if (len > 2 && strncmp(t->s + len - 2, "()", 2) == 0) {
+        len -= 2;
+    }
+    else { /* name () */
+        ps->pos++;
+    }
+    if (t->type != T_WORD || !isname(t->s, len)) {
+        syntax(ps);
+        return n;
+    }
+    n->text = csavestr(t->s, len);
+    ps->pos++;
+    skipseps(ps);
+    arena.persist++; /* the function table keeps the body */
+    n->body = parsecmd(ps);
+    arena.persist--;
+    return n;
+}
+
+/* parsecmd - One command: a compound command, function or simple command */
+struct node_t *parsecmd(struct parser_t *ps) {
+    static const char *reserved[] = {"then", "elif", "else", "fi", "do",
+        "done", "}", NULL};
+    static const char *groupstop[] = {"}", NULL};
+    struct tok_t *t = cur(ps);
+
+    if (t->type != T_WORD) {
+        syntax(ps);
+        return NULL;
+    }
+    if (iskw(ps, "if"))
+        return parseif(ps);
+    if (iskw(ps, "while") || iskw(ps, "until"))
+        return parseloop(ps);
+    if (iskw(ps, "for"))
+        return parsefor(ps);
+    if (iskw(ps, "{")) {
+        struct node_t *n = newnode(N_GROUP);
+        ps->pos++;
+        n->body = parselist(ps, groupstop);
+        if (!failed(ps))
+            expect(ps, "}");
+        return n;
+    }
+    if (iskw(ps, "function") || (!t->quoted && t->len > 2
+            && strncmp(t->s + t->len - 2, "()", 2) == 0))
+        return parsefunc(ps);
+    if (!t->quoted && t[1].type == T_WORD && t[1].len == 2
+            && strncmp(t[1].s, "()", 2) == 0)
+        return parsefunc(ps);
+    for (int i = 0; reserved[i] != NULL; i++)
+        if (iskw(ps, reserved[i])) {
+            syntax(ps);
+            return NULL;
+        }
+    return parsesimple(ps);
+}
+
+/* 
+ * parseandor - Commands joined by && and ||, which group from the left
+ *    with equal precedence. A line may break after either operator.
+ */
+struct node_t *parseandor(struct parser_t *ps) {
+    struct node_t *n = parsecmd(ps);
+
+    while (!failed(ps) && (cur(ps)->type == T_AND || cur(ps)->type == T_OR)) {
+        struct node_t *op = newnode(cur(ps)->type == T_AND ? N_AND : N_OR);
+        ps->pos++;
+        while (cur(ps)->type == T_SEP && *cur(ps)->s == '\n')
+            ps->pos++;
+        op->cond = n;
+        op->body = parsecmd(ps);
+        n = op;
+    }
+    return n;
+}
+
+/* 
+ * parselist - And-or lists separated by ; or newlines, up to one of
+ *    the reserved words in stops (or EOF when stops is NULL).
+ */
+struct node_t *parselist(struct parser_t *ps, const char **stops) {
+    struct node_t *head = NULL, **tail = &head;
+
+    while (!failed(ps)) {
+        skipseps(ps);
+        if (cur(ps)->type == T_EOF) {
+            if (stops != NULL)
+                ps->more = 1;
+            break;
+        }
+        int stop = 0;
+        for (int i = 0; stops != NULL && stops[i] != NULL; i++)
+            stop |= iskw(ps, stops[i]);
+        if (stop)
+            break;
+
+        *tail = parseandor(ps);
+        if (*tail != NULL)
+            tail = &(*tail)->next;
+        if (failed(ps))
+            break;
+        if (cur(ps)->type == T_WORD) { /* e.g. a word after done */
+            syntax(ps);
+            break;
+        }
+    }
+    return head;
+}
+
+/* 
+ * compile - Compile script text into *progp, in the arena apart from
+ *    function bodies. Returns C_OK, C_ERR after printing a syntax
+ *    error, or C_MORE if the text ends inside an if/while/for/function
+ *    that is still open.
+ */
+int compile(const char *text, struct node_t **progp) {
+    struct parser_t ps = {0};
+    jmp_buf full;
+    int more;
+
+    heredoc[0] = '\0';
+    *progp = NULL;
+    if (setjmp(full)) { /* function bodies parsed so far are lost */
+        arena.full = NULL;
+        arena.persist = 0;
+        printf("tsh: command too long\n");
+        return C_ERR;
+    }
+    arena.full = &full;
+    ps.tok = lexscript(text, &more);
+    *progp = parselist(&ps, NULL);
+    arena.full = NULL;
+    if (ps.more || more)
+        return C_MORE;
+    if (ps.err != NULL) {
+        if (ps.err->type == T_SEP)
+            printf("tsh: syntax error near unexpected token '%s'\n",
+                   *ps.err->s == ';' ? ";" : "newline");
+        else
+            printf("tsh: syntax error near '%.*s'\n", ps.err->len, ps.err->s);
+        return C_ERR;
+    }
+    return C_OK;
+}
+
+/* freewords - Free compiled words of a function body */
+void freewords(struct word_t *words, int nwords) {
+    for (int i = 0; i < nwords; i++) {
+        for (int j = 0; j < words[i].nsegs; j++) {
+            free(words[i].segs[j].lit);
+            free(words[i].segs[j].ops);
+            freenode(words[i].segs[j].prog);
+        }
+        free(words[i].segs);
+        free(words[i].lit);
+    }
+    free(words);
+}
+
+/* freenode - Free a function body, compiled onto the heap */
+void freenode(struct node_t *n) {
+    while (n != NULL) {
+        struct node_t *next = n->next;
+        freenode(n->cond);
+        freenode(n->body);
+        freenode(n->alt);
+        freewords(n->words, n->nwords);
+        free(n->text);
+        free(n);
+        n = next;
+    }
+}
+
+/* 
+ * dropfuncs - Free the bodies of function definitions in an arena list
+ *    that never ran, before the arena is reset under them
+ */
+void dropfuncs(struct node_t *n) {
+    for (; n != NULL; n = n->next) {
+        if (n->type == N_FUNC) {
+            freenode(n->body);
+            n->body = NULL;
+            continue;
+        }
+        dropfuncs(n->cond);
+        dropfuncs(n->body);
+        dropfuncs(n->alt);
+        for (int i = 0; i < n->nwords; i++)
+            for (int j = 0; j < n->words[i].nsegs; j++)
+                dropfuncs(n->words[i].segs[j].prog);
+    }
+}
+
+/* sgrow - Give a growing string room for cap bytes in all */
+void sgrow(struct str_t *b, size_t cap) {
+    char *s;
+
+    if (b->heap) {
+        b->s = Realloc(b->s, cap);
+    }
+    else if ((s = agrow(b->s, b->cap, cap)) != NULL) {
+        b->s = s;
+    }
+    else { /* too big for the arena */
+        s = Malloc(cap);
+        if (b->s != NULL)
+            memcpy(s, b->s, b->len + 1);
+        b->s = s;
+        b->heap = 1;
+    }
+    b->cap = cap;
+}
+
+/* sputn - Append n bytes to a growing string */
+void sputn(struct str_t *b, const char *s, size_t n) {
+    if (b->len + n + 1 > b->cap)
+        sgrow(b, 2 * (b->len + n + 1));
+    memcpy(b->s + b->len, s, n);
+    b->len += n;
+    b->s[b->len] = '\0';
+}
+
+/* 
+ * expandword - Expand a compiled word. Returns w->lit when there is
+ *    nothing to expand, otherwise a string in the arena, or on the
+ *    heap for the caller to free if *heap is set.
+ */
+char *expandword(struct word_t *w, int *heap) {
+    struct str_t b = {0};
+    char num[32];
+
+    *heap = 0;
+    if (w->segs == NULL)
+        return w->lit;
+    sputn(&b, "", 0);
+    for (int i = 0; i < w->nsegs; i++) {
+        struct seg_t *g = &w->segs[i];
+        const char *s = num;
+        switch (g->type) {
+            case S_LIT:
+                s = g->lit;
+                break;
+            case S_VAR:
+                s = g->var->value ? g->var->value : "";
+                break;
+            case S_ARG:
+                s = g->arg <= posc && posv ? posv[g->arg] : "";
+                break;
+            case S_NARGS:
+                sprintf(num, "%d", posc);
+                break;
+            case S_STATUS:
+                sprintf(num, "%d", status);
+                break;
+            case S_ARITH:
+                sprintf(num, "%ld", evalarith(g->ops, g->nops));
+                break;
+            case S_CMDSUB:
+                cmdsub(g, &b);
+                s = "";
+                break;
+            case S_ALL: /* inside a longer word: joined with spaces */
+                for (int j = 1; j <= posc; j++) {
+                    if (j > 1)
+                        sputn(&b, " ", 1);
+                    sputn(&b, posv[j], strlen(posv[j]));
+                }
+                s = "";
+                break;
+        }
+        sputn(&b, s, strlen(s));
+    }
+    *heap = b.heap;
+    return b.s;
+}
+
+/* argsinit - Start an empty argument vector in its built-in storage */
+void argsinit(struct args_t *a) {
+    a->v = a->vbuf;
+    a->cap = MAXARGS;
+    a->own = a->ownbuf;
+    a->owncap = MAXARGS;
+    a->n = a->nown = 0;
+    a->v[0] = NULL;
+}
+
+/* 
+ * argspush - Append s to the vector, moving it to the arena when full,
+ *    or to the heap once too big for the arena
+ */
+void argspush(struct args_t *a, char *s) {
+    if (a->n + 1 == a->cap) {
+        size_t size = a->cap * sizeof(char *);
+        char **v;
+        if (a->v != a->vbuf && !inarena(a->v)) {
+            v = Realloc(a->v, 2 * size);
+        }
+        else if ((v = agrow(a->v, size, 2 * size)) == NULL) {
+            v = Malloc(2 * size);
+            memcpy(v, a->v, size);
+        }
+        a->v = v;
+        a->cap *= 2;
+    }
+    a->v[a->n++] = s;
+    a->v[a->n] = NULL;
+}
+
+/* argsown - Remember a heap string for argsfree */
+void argsown(struct args_t *a, char *s) {
+    if (a->nown == a->owncap) {
+        char **own = Malloc(2 * a->owncap * sizeof(char *));
+        memcpy(own, a->own, a->nown * sizeof(char *));
+        if (a->own != a->ownbuf)
+            free(a->own);
+        a->own = own;
+        a->owncap *= 2;
+    }
+    a->own[a->nown++] = s;
+}
+
+/* argsfree - Free the strings and any heap storage of a vector */
+void argsfree(struct args_t *a) {
+    for (int i = 0; i < a->nown; i++)
+        free(a->own[i]);
+    if (a->v != a->vbuf && !inarena(a->v))
+        free(a->v);
+    if (a->own != a->ownbuf)
+        free(a->own);
+}
+
+/* 
+ * expandwords - Expand words onto a. $@ alone gives one word per
+ *    parameter; a word holding $(...) is split on blanks and newlines
+ *    in place, so the fields point into the one expanded string.
+ */
+void expandwords(struct word_t *w, int nwords, struct args_t *a) {
+    for (int i = 0; i < nwords; i++) {
+        if (w[i].nsegs == 1 && w[i].segs[0].type == S_ALL) {
+            for (int j = 1; j <= posc; j++)
+                argspush(a, posv[j]);
+            continue;
+        }
+        int heap;
+        char *s = expandword(&w[i], &heap);
+        if (heap)
+            argsown(a, s);
+        if (!w[i].split) {
+            argspush(a, s);
+            continue;
+        }
+        while (1) {
+            while (*s == ' ' || *s == '\t' || *s == '\n')
+                s++;
+            if (*s == '\0')
+                break;
+            argspush(a, s);
+            while (*s && *s != ' ' && *s != '\t' && *s != '\n')
+                s++;
+            if (*s)
+                *s++ = '\0';
+        }
+    }
+}
+
+/* 
+ * execcmd - Run a simple command: leading NAME=value words set shell
+ *    variables, the rest is expanded and run as a function, builtin
+ *    or program.
+ */
+int execcmd(struct node_t *n) {
+    struct args_t a;
+    int i, heap;
+    struct func_t *f;
+    size_t mark = amark();
+
+    substatus = -1;
+    for (i = 0; i < n->nwords && n->words[i].assign != NULL; i++) {
+        struct var_t *v = n->words[i].assign;
+        char *val = expandword(&n->words[i], &heap);
+        if (!heap) {
+            setvar(v, val);
+        }
+        else { /* hand a big string over rather than copy it */
+            free(v->value);
+            v->value = val;
+            v->cap = strlen(val) + 1;
+        }
+    }
+    if (i > 0) /* assignments alone give the status of their last $(...) */
+        status = substatus >= 0 ? substatus : 0;
+
+    argsinit(&a);
+    expandwords(n->words + i, n->nwords - i, &a);
+
+    if (a.n > 0 && (f = findfunc(a.v[0])) != NULL) {
+        char **savev = posv;
+        int savec = posc;
+        posv = a.v;
+        posc = a.n - 1;
+        funcdepth++;
+        execlist(f->body);
+        funcdepth--;
+        if (loopctl == L_RETURN)
+            loopctl = 0;
+        posv = savev;
+        posc = savec;
+    }
+    else if (a.n > 0) {
+        runcmd(a.v, a.n, n->text);
+    }
+
+    argsfree(&a);
+    arelease(mark);
+    return status;
+}
+
+/* capwrite - Write function of capout: append to capbuf */
+ssize_t capwrite(void *cookie, const char *s, size_t n) {
+    sputn(&capbuf, s, n);
+    return n;
+}
+
+/* 
+ * cmdsub - Run a compiled $(...) and append its output, less trailing
+ *    newlines and any NUL bytes, to b. A builtin-only list runs in the
+ *    shell with stdout swapped for capout, a stream onto the end of
+ *    capbuf; nested ones stack there and each takes its own part off
+ *    again. Anything else runs in a forked subshell through the normal
+ *    launch path; its output is read from a pipe, and once it outgrows
+ *    one read buffer the rest is spliced into a memfd, which is then
+ *    mapped and copied into b in a single pass sized from the memfd.
+ */
+void cmdsub(struct seg_t *g, struct str_t *b) {
+    char chunk[65536];
+    size_t start = b->len;
+    int fd[2], st;
+    pid_t pid;
+    sigset_t mask, prev;
+
+    fflush(stdout);
+    if (g->inproc && g->fgen != funcgen) { /* recheck for shadowing */
+        g->inproc = inprocok(g->prog);
+        g->fgen = funcgen;
+    }
+    if (g->inproc) {
+        FILE *save = stdout;
+        size_t at = capbuf.len;
+        if (capout == NULL) {
+            cookie_io_functions_t io = {.write = capwrite};
+            if ((capout = fopencookie(NULL, "w", io)) == NULL)
+                unix_error("fopencookie error");
+        }
+        stdout = capout;
+        execlist(g->prog);
+        fflush(capout);
+        stdout = save;
+        if (capbuf.len > at)
+            sputn(b, capbuf.s + at, capbuf.len - at);
+        capbuf.len = at;
+        substatus = status;
+    }
+    else {
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mask, &prev); /* we reap this child ourselves */
+        if (pipe(fd) < 0)
+            unix_error("pipe error");
+        if ((pid = fork()) < 0)
+            unix_error("fork error");
+        if (pid == 0) { /* subshell */
+            sigprocmask(SIG_SETMASK, &prev, NULL);
+            close(fd[0]);
+            dup2(fd[1], STDOUT_FILENO);
+            close(fd[1]);
+            stdout = shellout;
+            initjobs(jobs); /* the parent's jobs are not ours */
+            twreset();
+            execlist(g->prog);
+            fflush(stdout);
+            _exit(status);
+        }
+        close(fd[1]);
+
+        ssize_t n, got = 0;
+        while (got < (ssize_t)sizeof(chunk)
+               && (n = read(fd[0], chunk + got, sizeof(chunk) - got)) != 0) {
+            if (n < 0 && errno != EINTR)
+                break;
+            got += n > 0 ? n : 0;
+        }
+
+        int mfd = -1;
+        off_t size = got;
+        if (got == (ssize_t)sizeof(chunk)) {
+            if ((mfd = memfd_create("tsh-cmdsub", MFD_CLOEXEC)) < 0)
+                unix_error("memfd_create error");
+            fcntl(fd[0], F_SETPIPE_SZ, 1 << 20); /* fewer, larger splices */
+            if (write(mfd, chunk, got) != got)
+                unix_error("memfd write error");
+            while ((n = splice(fd[0], NULL, mfd, NULL, 1 << 20, SPLICE_F_MOVE)) != 0) {
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0) { /* no splice here: copy through chunk */
+                    while ((n = read(fd[0], chunk, sizeof(chunk))) != 0)
+                        if (n > 0 && write(mfd, chunk, n) != n)
+                            unix_error("memfd write error");
+                        else if (n < 0 && errno != EINTR)
+                            break;
+                    break;
+                }
+            }
+            size = lseek(mfd, 0, SEEK_END);
+        }
+        close(fd[0]);
+
+        if (b->len + size + 1 > b->cap)
+            sgrow(b, b->len + size + 1);
+        const char *p = chunk, *end = chunk + got;
+        void *map = NULL;
+        if (mfd >= 0) {
+            map = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, mfd, 0) : NULL;
+            if (map == MAP_FAILED)
+                unix_error("mmap error");
+            p = map;
+            end = p + size;
+        }
+        while (p < end) { /* copy, dropping NULs as they can't be in a word */
+            const char *z = memchr(p, '\0', end - p);
+            const char *q = z ? z : end;
+            memcpy(b->s + b->len, p, q - p);
+            b->len += q - p;
+            p = q + (z != NULL);
+        }
+        b->s[b->len] = '\0';
+        if (map != NULL)
+            munmap(map, size);
+        if (mfd >= 0)
+            close(mfd);
+
+        while (waitpid(pid, &st, 0) < 0 && errno == EINTR)
+            ;
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        substatus = WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st);
+    }
+
+    while (b->len > start && b->s[b->len - 1] == '\n')
+        b->len -= 1;
+    b->s[b->len] = '\0';
+}
+
+/* execloopbody - Run a loop body; returns 1 if the loop should stop */
+int execloopbody(struct node_t *body) {
+    execlist(body);
+    if (loopctl == L_BREAK) {
+        loopctl = 0;
+        return 1;
+    }
+    if (loopctl == L_CONTINUE)
+        loopctl = 0;
+    return loopctl != 0 || intr;
+}
+
+/* execnode - Run one compiled command; returns its exit status */
+int execnode(struct node_t *n) {
+    int st = 0;
+
+    switch (n->type) {
+        case N_CMD:
+            return execcmd(n);
+
+        case N_IF:
+            execlist(n->cond);
+            if (loopctl || intr)
+                return status;
+            if (status == 0)
+                return execlist(n->body);
+            if (n->alt != NULL)
+                return execlist(n->alt);
+            return status = 0;
+
+        case N_WHILE:
+        case N_UNTIL:
+            loopdepth++;
+            while (!intr) {
+                execlist(n->cond);
+                if (loopctl || (status == 0) != (n->type == N_WHILE))
+                    break;
+                int stop = execloopbody(n->body);
+                st = status;
+                if (stop)
+                    break;
+            }
+            loopdepth--;
+            return status = st;
+
+        case N_FOR: {
+            struct args_t a;
+            size_t mark = amark();
+            argsinit(&a);
+            if (n->nwords >= 0)
+                expandwords(n->words, n->nwords, &a);
+            else
+                for (int i = 1; i <= posc; i++)
+                    argspush(&a, posv[i]);
+            loopdepth++;
+            for (int i = 0; i < a.n && !intr; i++) {
+                setvar(n->var, a.v[i]);
+                int stop = execloopbody(n->body);
+                st = status;
+                if (stop)
+                    break;
+            }
+            loopdepth--;
+            argsfree(&a);
+            arelease(mark);
+            return status = st;
+        }
+
+        case N_FUNC:
+            if (n->body != NULL) { /* the function table takes the body */
+                definefunc(n->text, n->body);
+                n->body = NULL;
+            }
+            return status = 0;
+
+        case N_GROUP:
+            return execlist(n->body);
+
+        case N_AND:
+        case N_OR:
+            execlist(n->cond);
+            if (loopctl || intr || (status == 0) != (n->type == N_AND))
+                return status;
+            return execlist(n->body);
+    }
+    return status;
+}
+
+/* execlist - Run a command list, stopping early for break/continue/return */
+int execlist(struct node_t *n) {
+    for (; n != NULL && !loopctl && !intr; n = n->next)
+        execnode(n);
+    return status;
+}
+/*************************************
+ * end script compiler and interpreter
+ *************************************/
+
+
+/*************************************
+ * Task graphs
+ *************************************/
+
+/*
+ * dag runs a file of tasks. A task is a line naming it and the tasks
+ * it depends on, then the indented command lines it runs:
+ *
+ *     # comment
+ *     link: cc_main cc_jobs
+ *         /usr/bin/cc -o tsh main.o jobs.o
+ *
+ * Each task runs in a subshell of its own, listed in the job table as
+ * a background job, and all its processes stay in that job's process
+ * group. Tasks start as soon as their prerequisites have succeeded,
+ * up to the parallelism limit and the free job slots.
+ */
+
+#define TK_WAIT 0 /* prerequisites not done yet */
+#define TK_RUN  1 /* running */
+#define TK_OK   2 /* exited 0 */
+#define TK_FAIL 3 /* failed, timed out or interrupted */
+
+struct task_t {             /* One task of a dag run */
+    char *name;
+    char *text;             /* its command lines */
+    struct node_t *prog;    /* compiled from text */
+    int *deps, ndeps;       /* prerequisites, as task indexes */
+    int *users, nusers;     /* tasks that have it as a prerequisite */
+    int waiting;            /* prerequisites that have not succeeded */
+    int state;              /* TK_WAIT, TK_RUN, TK_OK or TK_FAIL */
+    int status;             /* exit status, -1 until it ends */
+    pid_t pid;
+    unsigned long long start, end; /* clockms */
+    unsigned long long chain; /* longest chain of tasks ending with it */
+    int via;                /* prerequisite on that chain, or -1 */
+};
+
+/* 
+ * dagparse - Parse a task file, in place, into tasks in the arena and
+ *    a topological order of them. Returns the number of tasks, or -1
+ *    after printing an error.
+ */
+int dagparse(char *text, const char *file, struct task_t **tasksp, int **orderp) {
+    struct task_t *tasks, *t = NULL;
+    char **names, *p, *e, *tend = NULL;
+    int *idx, *order;
+    int ntasks = 0, ndeps = 0, line = 0, last = 0, i, j, k, n;
+
+    /* Size everything first: at most one dependency per word */
+    for (p = text; *p; p = *e ? e + 1 : e) {
+        e = strchrnul(p, '\n');
+        if (p == e || *p == '#' || *p == ' ' || *p == '\t')
+            continue;
+        ntasks++;
+        for (char *w = p; w < e; w++)
+            ndeps += !isspace((unsigned char)*w) && (w == p || isspace((unsigned char)w[-1]));
+    }
+    tasks = aalloc(ntasks * sizeof(struct task_t));
+    names = aalloc(ndeps * sizeof(char *));
+    idx = aalloc(2 * ndeps * sizeof(int));
+    order = aalloc(ntasks * sizeof(int));
+    if (tasks == NULL || names == NULL || idx == NULL || order == NULL) {
+        printf("dag: %s: too many tasks\n", file);
+        return -1;
+    }
+
+    ntasks = ndeps = 0;
+    for (p = text; !last; p = e + 1) {
+        e = strchrnul(p, '\n');
+        last = *e == '\0';
+        line++;
+        if (*p == ' ' || *p == '\t') { /* a command line of the task */
+            if (strspn(p, " \t\r") == (size_t)(e - p))
+                continue;
+            if (t == NULL) {
+                printf("dag: %s:%d: command before the first task\n", file, line);
+                return -1;
+            }
+            if (t->text == NULL)
+                t->text = p;
+            tend = e;
+            continue;
+        }
+        if (p == e || *p == '#')
+            continue;
+
+        if (tend != NULL) /* end the commands of the task before */
+            *tend = '\0';
+        tend = NULL;
+        t = &tasks[ntasks++];
+        memset(t, 0, sizeof(struct task_t));
+        t->status = -1;
+        t->via = -1;
+        *e = '\0';
+        char *colon = strchr(p, ':'), *ne = colon;
+        while (ne != NULL && ne > p && isblank((unsigned char)ne[-1]))
+            ne--;
+        if (colon == NULL || ne == p) {
+            printf("dag: %s:%d: expected NAME: [PREREQUISITE ...]\n", file, line);
+            return -1;
+        }
+        *ne = '\0';
+        t->name = p;
+        t->deps = idx + ndeps;
+        for (char *w = colon + 1; *(w += strspn(w, " \t\r")) != '\0'; ) {
+            names[ndeps + t->ndeps++] = w;
+            w += strcspn(w, " \t\r");
+            if (*w)
+                *w++ = '\0';
+        }
+        ndeps += t->ndeps;
+    }
+    if (tend != NULL)
+        *tend = '\0';
+
+    /* Resolve names, and list each task's users after the dependencies */
+    for (i = 0; i < ntasks; i++) {
+        for (j = 0; j < i; j++)
+            if (strcmp(tasks[i].name, tasks[j].name) == 0) {
+                printf("dag: %s: task %s defined twice\n", file, tasks[i].name);
+                return -1;
+            }
+        for (j = 0; j < tasks[i].ndeps; j++) {
+            char *dep = names[tasks[i].deps - idx + j];
+            for (k = 0; k < ntasks && strcmp(tasks[k].name, dep) != 0; k++)
+                ;
+            if (k == ntasks) {
+                printf("dag: %s: task %s needs unknown task %s\n", file, tasks[i].name, dep);
+                return -1;
+            }
+            tasks[i].deps[j] = k;
+            tasks[k].nusers++;
+        }
+    }
+    for (i = 0, n = ndeps; i < ntasks; i++) {
+        tasks[i].users = idx + n;
+        n += tasks[i].nusers;
+        tasks[i].nusers = 0;
+    }
+    for (i = 0; i < ntasks; i++)
+        for (j = 0; j < tasks[i].ndeps; j++) {
+            struct task_t *d = &tasks[tasks[i].deps[j]];
+            d->users[d->nusers++] = i;
+        }
+
+    /* Order the tasks so each comes after its prerequisites */
+    for (i = 0, n = 0; i < ntasks; i++)
+        if ((tasks[i].waiting = tasks[i].ndeps) == 0)
+            order[n++] = i;
+    for (i = 0; i < n; i++) {
+        t = &tasks[order[i]];
+        for (j = 0; j < t->nusers; j++)
+            if (--tasks[t->users[j]].waiting == 0)
+                order[n++] = t->users[j];
+    }
+    if (n < ntasks) {
+        for (i = 0; tasks[i].waiting == 0; i++)
+            ;
+        printf("dag: %s: dependency cycle through task %s\n", file, tasks[i].name);
+        return -1;
+    }
+    *tasksp = tasks;
+    *orderp = order;
+    return ntasks;
+}
+
+/* 
+ * dagstart - Start a task in a subshell that is a background job of
+ *    its own; the job's exit status lands in t->status. SIGCHLD is
+ *    blocked, and prev is the mask to restore in the subshell.
+ */
+int dagstart(struct task_t *t, sigset_t *prev) {
+    pid_t pid;
+
+    snprintf(sbuf, MAXLINE, "dag %s\n", t->name);
+    fflush(stdout);
+    if ((pid = fork()) < 0) {
+        printf("dag: fork error: %s\n", strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        Signal(SIGINT, SIG_DFL); /* dag interrupts the whole group */
+        Signal(SIGTSTP, SIG_DFL);
+        sigprocmask(SIG_SETMASK, prev, NULL);
+        initjobs(jobs);
+        twreset();
+        nojobctl = 1;
+        timeoutms = 0;
+        status = 0;
+        execlist(t->prog);
+        fflush(stdout);
+        _exit(status);
+    }
+    setpgid(pid, pid);
+    addjob(jobs, pid, BG, sbuf);
+    getjobpid(jobs, pid)->exitp = &t->status;
+    t->pid = pid;
+    t->state = TK_RUN;
+    t->start = clockms();
+    return 0;
+}
+
+/* dagpath - Print the chain of tasks ending with task i */
+void dagpath(struct task_t *tasks, int i) {
+    if (tasks[i].via >= 0) {
+        dagpath(tasks, tasks[i].via);
+        printf(" > ");
+    }
+    printf("%s", tasks[i].name);
+}
+
+/* dagreport - Print wall time against the critical path and serial time */
+void dagreport(struct task_t *tasks, int *order, int ntasks, int limit,
+               unsigned long long wall) {
+    unsigned long long serial = 0;
+    int i, j, ran = 0, top = -1;
+
+    for (i = 0; i < ntasks; i++) {
+        struct task_t *t = &tasks[order[i]];
+        if (t->state == TK_WAIT)
+            continue;
+        ran++;
+        serial += t->end - t->start;
+        t->chain = 0;
+        for (j = 0; j < t->ndeps; j++)
+            if (tasks[t->deps[j]].chain > t->chain) {
+                t->chain = tasks[t->deps[j]].chain;
+                t->via = t->deps[j];
+            }
+        t->chain += t->end - t->start;
+        if (top < 0 || t->chain > tasks[top].chain)
+            top = order[i];
+    }
+    printf("dag: %d tasks in %.2fs, %d at a time; ", ran, wall / 1000.0, limit);
+    if (top < 0) {
+        printf("nothing ran\n");
+        return;
+    }
+    printf("critical path %.2fs (", tasks[top].chain / 1000.0);
+    dagpath(tasks, top);
+    printf("), serial %.2fs\n", serial / 1000.0);
+}
+
+/* 
+ * do_dag - Execute the builtin dag [-k] [-t] [-j N] FILE. Runs the
+ *    tasks of FILE, up to N at once (by default one per CPU). After a
+ *    failure no more tasks are started, or with -k none of those that
+ *    depend on it; ctrl-c interrupts all running tasks. -t reports the
+ *    time taken against the critical path and against running the
+ *    tasks one after another. Returns the status of the first task
+ *    that failed, or 0.
+ */
+int do_dag(char **argv) {
+    int keepgoing = 0, report = 0, limit = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, fd, ntasks, *order, *ready, head = 0, tail = 0;
+    int running = 0, stop = 0, cancelled = 0, failed = 0, notrun = 0;
+    int firstfail = 0;
+    struct task_t *tasks;
+    struct stat sb;
+    sigset_t mask, prev;
+    char *text;
+
+    for (i = 1; argv[i] != NULL && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-k") == 0)
+            keepgoing = 1;
+        else if (strcmp(argv[i], "-t") == 0)
+            report = 1;
+        else if (strncmp(argv[i], "-j", 2) == 0) {
+            char *n = argv[i][2] ? argv[i] + 2 : argv[++i];
+            if (n == NULL || (limit = atoi(n)) < 1)
+                break;
+        }
+        else
+            break;
+    }
+    if (argv[i] == NULL || argv[i][0] == '-' || argv[i + 1] != NULL || limit < 1) {
+        printf("dag: usage: dag [-k] [-t] [-j N] FILE\n");
+        return 2;
+    }
+
+    /* The file, its tasks and their compiled commands go in the arena */
+    if ((fd = open(argv[i], O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+        printf("dag: %s: %s\n", argv[i], strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return 2;
+    }
+    text = aalloc(sb.st_size + 1);
+    ssize_t got = 0, n = 0;
+    while (text != NULL && got < sb.st_size
+           && ((n = read(fd, text + got, sb.st_size - got)) > 0 || (n < 0 && errno == EINTR)))
+        got += n > 0 ? n : 0;
+    close(fd);
+    if (text == NULL) {
+        printf("dag: %s: too big\n", argv[i]);
+        return 2;
+    }
+    text[got] = '\0';
+    if ((ntasks = dagparse(text, argv[i], &tasks, &order)) < 0)
+        return 2;
+    for (int k = 0; k < ntasks; k++) {
+        if (tasks[k].text != NULL && compile(tasks[k].text, &tasks[k].prog) != C_OK) {
+            printf("dag: %s: bad commands for task %s\n", argv[i], tasks[k].name);
+            heredoc[0] = '\0';
+            while (k >= 0)
+                dropfuncs(tasks[k--].prog);
+            return 2;
+        }
+    }
+    if ((ready = aalloc(ntasks * sizeof(int))) == NULL) {
+        printf("dag: %s: too many tasks\n", argv[i]);
+        return 2;
+    }
+    for (int k = 0; k < ntasks; k++)
+        if ((tasks[k].waiting = tasks[k].ndeps) == 0)
+            ready[tail++] = k;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    unsigned long long start = clockms();
+    while (1) {
+        int slots = 0;
+        for (int k = 0; k < MAXJOBS; k++)
+            slots += jobs[k].pid == 0;
+        while (head < tail && running < limit && slots > 0 && !stop && !intr) {
+            if (dagstart(&tasks[ready[head++]], &prev) < 0) {
+                stop = 1;
+                break;
+            }
+            running++;
+            slots--;
+        }
+        if (running == 0) {
+            if (head < tail && !stop && !intr)
+                printf("dag: no free job slots\n");
+            break;
+        }
+
+        twwait(&prev);
+        if (intr && !cancelled) {
+            for (int k = 0; k < ntasks; k++)
+                if (tasks[k].state == TK_RUN)
+                    kill(-tasks[k].pid, SIGINT);
+            cancelled = stop = 1;
+        }
+
+        /* Tasks that ended free their users, or stop the run */
+        for (int k = 0; k < ntasks; k++) {
+            struct task_t *t = &tasks[k];
+            if (t->state != TK_RUN || t->status < 0)
+                continue;
+            t->end = clockms();
+            running--;
+            if (t->status == 0) {
+                t->state = TK_OK;
+                for (int u = 0; u < t->nusers; u++)
+                    if (--tasks[t->users[u]].waiting == 0)
+                        ready[tail++] = t->users[u];
+                continue;
+            }
+            t->state = TK_FAIL;
+            if (!failed++)
+                firstfail = t->status;
+            if (!cancelled)
+                printf("dag: task %s failed with status %d\n", t->name, t->status);
+            stop |= !keepgoing;
+        }
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+
+    for (int k = 0; k < ntasks; k++) {
+        notrun += tasks[k].state == TK_WAIT;
+        dropfuncs(tasks[k].prog);
+    }
+    if (notrun > 0)
+        printf("dag: %d of %d tasks not run\n", notrun, ntasks);
+    if (report)
+        dagreport(tasks, order, ntasks, limit, clockms() - start);
+    if (cancelled)
+        return 130;
+    return failed ? firstfail : notrun > 0;
+}
+/*************************************
+ * end task graphs
+ *************************************/
+
+
+/*************************************
+ * Line editor
+ *************************************/
+
+/*
+ * When a person is typing, editline reads each command line with the
+ * terminal in raw mode and edits it in place:
+ *
+ *     ^A ^E, Home End      start, end of line
+ *     ^B ^F, Left Right    back, forward a character
+ *     M-b M-f              back, forward a word
+ *     Backspace, ^D Del    delete before, at the cursor (^D on an
+ *                          empty line is end of file)
+ *     ^K ^U ^W M-d         kill to end, to start, a word back, forward
+ *     ^Y                   yank the last kill
+ *     ^L                   clear the screen
+ *     ^C                   abandon the line
+ *     Tab                  complete the word before the cursor
+ *
+ * Tab completes a command from the builtins, the shell functions and
+ * the executables on PATH, and any other word as a file name. The
+ * executables are held in cmdidx, sorted, so the names that start with
+ * a prefix are one binary search away. It is built when the editor
+ * first runs, after putting an inotify watch on each PATH directory,
+ * and the shell applies the events as they come in, so a Tab never
+ * reads a directory of PATH. Changes made to an NFS directory by other
+ * hosts raise no events and show up when the shell next starts.
+ */
+
+struct edit_t {             /* A line being edited */
+    char *buf;              /* the text, NUL terminated */
+    int len, pos;           /* its length and the cursor */
+    int size;               /* room in buf */
+    const char *prompt;
+    int plen;
+};
+
+struct cands_t {            /* Completions of a word, in the arena */
+    char **v;
+    int n, cap;
+};
+
+char killbuf[MAXLINE];      /* the text last killed, for ^Y */
+int killlen;
+
+/* cmdcmp - Order command index entries by name, for qsort */
+int cmdcmp(const void *a, const void *b) {
+    return strcmp(((const struct cmdent_t *)a)->name,
+                  ((const struct cmdent_t *)b)->name);
+}
+
+/*
+ * cmdbound - Index of the first entry of cmdidx not below s[0..len),
+ *    or with upper set, the first past those that start with it
+ */
+int cmdbound(const char *s, int len, int upper) {
+    int lo = 0, hi = cmdidx.n;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int c = strncmp(cmdidx.ent[mid].name, s, len);
+        if (c < 0 || (upper && c == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* onpath - Is name in the command index? */
+int onpath(const char *name) {
+    int i = cmdbound(name, strlen(name) + 1, 0);
+
+    return i < cmdidx.n && strcmp(cmdidx.ent[i].name, name) == 0;
+}
+
+/* cmdgrow - Make room for one more entry in the command index */
+void cmdgrow(void) {
+    if (cmdidx.n == cmdidx.cap) {
+        cmdidx.cap = cmdidx.cap ? 2 * cmdidx.cap : 1024;
+        cmdidx.ent = Realloc(cmdidx.ent, cmdidx.cap * sizeof(struct cmdent_t));
+    }
+}
+
+/*
+ * cmdset - Record whether PATH directory d has an executable called
+ *    name, inserting or deleting its entry to keep the index sorted
+ */
+void cmdset(const char *name, int d, int on) {
+    int i = cmdbound(name, strlen(name) + 1, 0);
+    struct cmdent_t *e = cmdidx.ent + i;
+
+    if (i < cmdidx.n && strcmp(e->name, name) == 0) {
+        if (on)
+            e->dirs |= 1ULL << d;
+        else if ((e->dirs &= ~(1ULL << d)) == 0) {
+            free(e->name);
+            memmove(e, e + 1, (cmdidx.n - i - 1) * sizeof(struct cmdent_t));
+            cmdidx.n--;
+        }
+    }
+    else if (on) {
+        cmdgrow();
+        e = cmdidx.ent + i;
+        memmove(e + 1, e, (cmdidx.n - i) * sizeof(struct cmdent_t));
+        e->name = savestr(name, strlen(name));
+        e->dirs = 1ULL << d;
+        cmdidx.n++;
+    }
+}
+
+/* cmddrop - Take PATH directory d out of every entry of the index */
+void cmddrop(int d) {
+    int i, j;
+
+    for (i = j = 0; i < cmdidx.n; i++) {
+        if ((cmdidx.ent[i].dirs &= ~(1ULL << d)) != 0)
+            cmdidx.ent[j++] = cmdidx.ent[i];
+        else
+            free(cmdidx.ent[i].name);
+    }
+    cmdidx.n = j;
+}
+
+/* isexec - Is name in PATH directory d an executable file? */
+int isexec(int d, const char *name) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s", cmdidx.dir[d], name);
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode)
+        && (st.st_mode & 0111);
+}
+
+/* pathload - Fill the command index by reading every PATH directory */
+void pathload(void) {
+    int d, i, j;
+
+    for (i = 0; i < cmdidx.n; i++)
+        free(cmdidx.ent[i].name);
+    cmdidx.n = 0;
+    for (d = 0; d < cmdidx.ndirs; d++) {
+        DIR *dp = opendir(cmdidx.dir[d]);
+        struct dirent *de;
+        struct stat st;
+
+        if (dp == NULL)
+            continue;
+        while ((de = readdir(dp)) != NULL) {
+            if (de->d_type == DT_DIR
+                    || fstatat(dirfd(dp), de->d_name, &st, 0) < 0
+                    || !S_ISREG(st.st_mode) || !(st.st_mode & 0111))
+                continue;
+            cmdgrow();
+            cmdidx.ent[cmdidx.n].name = savestr(de->d_name, strlen(de->d_name));
+            cmdidx.ent[cmdidx.n++].dirs = 1ULL << d;
+        }
+        closedir(dp);
+    }
+    if (cmdidx.n == 0)
+        return;
+
+    /* Sort, then merge the names found in more than one directory */
+    qsort(cmdidx.ent, cmdidx.n, sizeof(struct cmdent_t), cmdcmp);
+    for (i = j = 0; i < cmdidx.n; i++) {
+        if (j > 0 && strcmp(cmdidx.ent[j - 1].name, cmdidx.ent[i].name) == 0) {
+            cmdidx.ent[j - 1].dirs |= cmdidx.ent[i].dirs;
+            free(cmdidx.ent[i].name);
+        }
+        else
+            cmdidx.ent[j++] = cmdidx.ent[i];
+    }
+    cmdidx.n = j;
+}
+
+/*
+ * pathindex - Build the command index, once. Each PATH directory is
+ *    watched before it is read, so no change can slip in between.
+ *    Relative directories are left out, as their meaning moves with cd.
+ */
+void pathindex(void) {
+    char *path, *p, *q;
+
+    if (cmdidx.built)
+        return;
+    cmdidx.built = 1;
+    cmdidx.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if ((p = getenv("PATH")) == NULL)
+        p = "/bin:/usr/bin";
+    path = p = savestr(p, strlen(p));
+    for (; p != NULL && cmdidx.ndirs < MAXPATHDIRS; p = q) {
+        int d;
+
+        if ((q = strchr(p, ':')) != NULL)
+            *q++ = '\0';
+        for (d = 0; d < cmdidx.ndirs && strcmp(cmdidx.dir[d], p) != 0; d++)
+            ;
+        if (p[0] != '/' || d < cmdidx.ndirs)
+            continue;
+        cmdidx.dir[d] = savestr(p, strlen(p));
+        cmdidx.wd[d] = cmdidx.fd < 0 ? -1 : inotify_add_watch(cmdidx.fd, p,
+            IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO
+            | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+        cmdidx.ndirs++;
+    }
+    free(path);
+    pathload();
+}
+
+/*
+ * pathsync - Apply the changes to PATH directories that inotify has
+ *    queued to the command index. If the queue overflowed, read the
+ *    directories again.
+ */
+void pathsync(void) {
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    int reload = 0;
+
+    if (cmdidx.fd < 0)
+        return;
+    while ((n = read(cmdidx.fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            int d;
+
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                reload = 1;
+                continue;
+            }
+            for (d = 0; d < cmdidx.ndirs && cmdidx.wd[d] != ev->wd; d++)
+                ;
+            if (d == cmdidx.ndirs)
+                continue;
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                inotify_rm_watch(cmdidx.fd, cmdidx.wd[d]);
+                cmdidx.wd[d] = -1;
+                cmddrop(d);
+            }
+            else if (ev->len == 0)
+                continue;
+            else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+                cmdset(ev->name, d, 0);
+            else
+                cmdset(ev->name, d, isexec(d, ev->name));
+        }
+    }
+    if (reload)
+        pathload();
+}
+
+/*
+ * cmdcomplete - Find the executables on PATH whose names start with
+ *    s[0..len). Returns how many there are; the first is
+ *    cmdidx.ent[*lo], and *lcp is the length of the prefix all share.
+ */
+int cmdcomplete(const char *s, int len, int *lo, int *lcp) {
+    int hi;
+
+    pathindex();
+    pathsync();
+    *lo = cmdbound(s, len, 0);
+    hi = cmdbound(s, len, 1);
+    *lcp = 0;
+    if (hi > *lo) {
+        const char *a = cmdidx.ent[*lo].name, *b = cmdidx.ent[hi - 1].name;
+        while (a[*lcp] != '\0' && a[*lcp] == b[*lcp])
+            (*lcp)++;
+    }
+    return hi - *lo;
+}
+
+/* addcand - Add s to the completions, unless the arena is full */
+void addcand(struct cands_t *c, char *s) {
+    if (c->n == c->cap) {
+        int cap = c->cap ? 2 * c->cap : 16;
+        char **v = agrow(c->v, c->cap * sizeof(char *), cap * sizeof(char *));
+        if (v == NULL)
+            return;
+        c->v = v;
+        c->cap = cap;
+    }
+    c->v[c->n++] = s;
+}
+
+/*
+ * filecands - Add the file names that complete the word at
+ *    buf[start..pos) to c, directories with a slash after them.
+ *    Returns where the last component of the word starts.
+ */
+int filecands(struct edit_t *e, int start, struct cands_t *c) {
+    char *dir = ".", *s;
+    const char *name;
+    int base, n;
+    DIR *dp;
+    struct dirent *de;
+    struct stat st;
+
+    for (base = e->pos; base > start && e->buf[base - 1] != '/'; base--)
+        ;
+    if (base > start && (dir = aalloc(base - start + 1)) != NULL) {
+        memcpy(dir, e->buf + start, base - start);
+        dir[base - start] = '\0';
+    }
+    name = e->buf + base;
+    n = e->pos - base;
+    if (dir == NULL || (dp = opendir(dir)) == NULL)
+        return base;
+    while ((de = readdir(dp)) != NULL) {
+        int len = strlen(de->d_name), isdir;
+
+        if (strncmp(de->d_name, name, n) != 0 || (de->d_name[0] == '.'
+                && (n == 0 || strcmp(de->d_name, ".") == 0
+                    || strcmp(de->d_name, "..") == 0)))
+            continue;
+        isdir = de->d_type == DT_DIR || ((de->d_type == DT_LNK
+                || de->d_type == DT_UNKNOWN)
+            && fstatat(dirfd(dp), de->d_name, &st, 0) == 0
+            && S_ISDIR(st.st_mode));
+        if ((s = aalloc(len + 2)) == NULL)
+            break;
+        memcpy(s, de->d_name, len);
+        strcpy(s + len, isdir ? "/" : "");
+        addcand(c, s);
+    }
+    closedir(dp);
+    return base;
+}
+
+/*
+ * cmdword - Is the word at buf[start] in command position: first on
+ *    the line, after an operator, or after a keyword that opens a list?
+ */
+int cmdword(const char *buf, int start) {
+    static const char *kw[] = {"if", "then", "elif", "else", "do",
+        "while", "until", "{", NULL};
+    int i = start, j, k;
+
+    while (i > 0 && (buf[i - 1] == ' ' || buf[i - 1] == '\t'))
+        i--;
+    if (i == 0 || strchr(";&|(", buf[i - 1]))
+        return 1;
+    for (j = i; j > 0 && !strchr(" \t;&|()<>", buf[j - 1]); j--)
+        ;
+    if (j >= 2 && buf[j - 1] == '&' && buf[j - 2] == '|') { /* |&N */
+        for (k = j; k < i && isdigit((unsigned char)buf[k]); k++)
+            ;
+        return k == i;
+    }
+    for (k = 0; kw[k] != NULL; k++)
+        if ((int)strlen(kw[k]) == i - j && strncmp(buf + j, kw[k], i - j) == 0)
+            return cmdword(buf, j);
+    return 0;
+}
+
+/* edwrite - Send n bytes to the terminal */
+void edwrite(const char *s, int n) {
+    while (n > 0) {
+        ssize_t k = write(STDOUT_FILENO, s, n);
+        if (k < 0 && errno != EINTR)
+            return;
+        if (k > 0) {
+            s += k;
+            n -= k;
+        }
+    }
+}
+
+/*
+ * edrefresh - Redraw the prompt and the line, scrolled sideways when
+ *    it is too long for the terminal so the cursor stays in view
+ */
+void edrefresh(struct edit_t *e) {
+    char out[2 * MAXLINE + 64];
+    struct winsize ws;
+    int cols = 80, room, from = 0, n, k;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+        cols = ws.ws_col;
+    if ((room = cols - 1 - e->plen) < 1)
+        room = 1;
+    if (e->pos > room)
+        from = e->pos - room;
+    if ((n = e->len - from) > room)
+        n = room;
+    k = snprintf(out, MAXLINE, "\r%s", e->prompt);
+    memcpy(out + k, e->buf + from, n);
+    k += n;
+    k += sprintf(out + k, "\x1b[K\r");
+    if (e->plen + e->pos - from > 0)
+        k += sprintf(out + k, "\x1b[%dC", e->plen + e->pos - from);
+    edwrite(out, k);
+}
+
+/* edinsert - Insert s[0..n) at the cursor, as much as fits */
+void edinsert(struct edit_t *e, const char *s, int n) {
+    if (n > e->size - 2 - e->len) /* keep room for the newline */
+        n = e->size - 2 - e->len;
+    if (n <= 0)
+        return;
+    memmove(e->buf + e->pos + n, e->buf + e->pos, e->len - e->pos + 1);
+    memcpy(e->buf + e->pos, s, n);
+    e->len += n;
+    e->pos += n;
+}
+
+/* eddelete - Delete buf[from..to), moving the cursor with the text */
+void eddelete(struct edit_t *e, int from, int to) {
+    if (to > e->len)
+        to = e->len;
+    if (from >= to)
+        return;
+    memmove(e->buf + from, e->buf + to, e->len - to + 1);
+    e->len -= to - from;
+    if (e->pos >= to)
+        e->pos -= to - from;
+    else if (e->pos > from)
+        e->pos = from;
+}
+
+/* edkill - Delete buf[from..to), keeping it for ^Y */
+void edkill(struct edit_t *e, int from, int to) {
+    if (from >= to)
+        return;
+    killlen = to - from;
+    memcpy(killbuf, e->buf + from, killlen);
+    eddelete(e, from, to);
+}
+
+/* wordback - Where the word before the cursor starts */
+int wordback(struct edit_t *e) {
+    int i = e->pos;
+
+    while (i > 0 && isspace((unsigned char)e->buf[i - 1]))
+        i--;
+    while (i > 0 && !isspace((unsigned char)e->buf[i - 1]))
+        i--;
+    return i;
+}
+
+/* wordfwd - Where the word after the cursor ends */
+int wordfwd(struct edit_t *e) {
+    int i = e->pos;
+
+    while (i < e->len && isspace((unsigned char)e->buf[i]))
+        i++;
+    while (i < e->len && !isspace((unsigned char)e->buf[i]))
+        i++;
+    return i;
+}
+
+/* candcmp - Order completions by name, for qsort */
+int candcmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * edlist - Show the completions below the line, in columns, at most
+ *    LISTMAX of them out of total
+ */
+void edlist(struct cands_t *c, int total) {
+    struct winsize ws;
+    int cols = 80, width = 0, across, n = c->n < LISTMAX ? c->n : LISTMAX;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+        cols = ws.ws_col;
+    qsort(c->v, c->n, sizeof(char *), candcmp);
+    for (int i = 0; i < n; i++)
+        if ((int)strlen(c->v[i]) > width)
+            width = strlen(c->v[i]);
+    width += 2;
+    if ((across = cols / width) < 1)
+        across = 1;
+    printf("\n");
+    for (int i = 0; i < n; i++) {
+        if (i % across == across - 1 || i == n - 1)
+            printf("%s\n", c->v[i]);
+        else
+            printf("%-*s", width, c->v[i]);
+    }
+    if (total > n)
+        printf("(%d more)\n", total - n);
+    fflush(stdout);
+}
+
+/*
+ * edcomplete - Complete the word before the cursor as far as all its
+ *    completions agree. A unique one is finished with a space; when
+ *    they part at once, they are listed.
+ */
+void edcomplete(struct edit_t *e) {
+    size_t mark = amark();
+    struct cands_t c = {NULL, 0, 0};
+    const char *word, *first;
+    int start, base, typed, nidx = 0, lo = 0, lcp = 0, common, total, i;
+
+    for (start = e->pos; start > 0 && !strchr(" \t;&|()<>", e->buf[start - 1]);
+            start--)
+        ;
+    word = e->buf + start;
+    typed = e->pos - start;
+    if (cmdword(e->buf, start) && memchr(word, '/', typed) == NULL) {
+        base = start;
+        nidx = cmdcomplete(word, typed, &lo, &lcp);
+        for (i = 0; builtins[i] != NULL; i++)
+            if (strncmp(builtins[i], word, typed) == 0 && !onpath(builtins[i]))
+                addcand(&c, (char *)builtins[i]);
+        for (i = 0; i < VARHASH; i++)
+            for (struct func_t *f = funcs[i]; f != NULL; f = f->next)
+                if (strncmp(f->name, word, typed) == 0 && !onpath(f->name)
+                        && !isbuiltin(f->name))
+                    addcand(&c, f->name);
+    }
+    else {
+        base = filecands(e, start, &c);
+        typed = e->pos - base;
+    }
+
+    total = c.n + nidx;
+    if (total == 0) {
+        edwrite("\a", 1);
+        arelease(mark);
+        return;
+    }
+    first = c.n ? c.v[0] : cmdidx.ent[lo].name;
+    common = c.n ? (int)strlen(first) : lcp;
+    for (i = 1; i < c.n; i++)
+        while (common > 0 && strncmp(first, c.v[i], common) != 0)
+            common--;
+    if (c.n && nidx) {
+        if (common > lcp)
+            common = lcp;
+        while (common > 0 && strncmp(first, cmdidx.ent[lo].name, common) != 0)
+            common--;
+    }
+    if (common > typed)
+        edinsert(e, first + typed, common - typed);
+    if (total == 1 && first[common - 1] != '/')
+        edinsert(e, " ", 1);
+    else if (total > 1 && common == typed) {
+        for (i = 0; i < nidx && c.n < LISTMAX; i++)
+            addcand(&c, cmdidx.ent[lo + i].name);
+        edlist(&c, total);
+    }
+    arelease(mark);
+}
+
+/* edgetc - The next byte typed, or -1 at end of file */
+int edgetc(void) {
+    static unsigned char in[256];
+    static int pos, len;
+
+    while (pos == len) {
+        waitinput();
+        pos = 0;
+        if ((len = read(STDIN_FILENO, in, sizeof(in))) < 0) {
+            len = 0;
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+        }
+        if (len <= 0)
+            return -1;
+    }
+    return in[pos++];
+}
+
+/*
+ * edescape - Act on the rest of an escape sequence: the arrow, Home,
+ *    End and Delete keys, and the meta (Alt) word commands
+ */
+void edescape(struct edit_t *e) {
+    int c = edgetc(), n = 0;
+
+    if (c == 'b')
+        e->pos = wordback(e);
+    else if (c == 'f')
+        e->pos = wordfwd(e);
+    else if (c == 'd')
+        edkill(e, e->pos, wordfwd(e));
+    else if (c == 127 || c == '\b')
+        edkill(e, wordback(e), e->pos);
+    else if (c == 'O' || c == '[') {
+        while ((c = edgetc()) >= '0' && c <= '9')
+            n = 10 * n + c - '0';
+        while (c == ';' || (c >= '0' && c <= '9')) /* modifiers */
+            c = edgetc();
+        if (c == 'C' && e->pos < e->len)
+            e->pos++;
+        else if (c == 'D' && e->pos > 0)
+            e->pos--;
+        else if (c == 'H' || (c == '~' && (n == 1 || n == 7)))
+            e->pos = 0;
+        else if (c == 'F' || (c == '~' && (n == 4 || n == 8)))
+            e->pos = e->len;
+        else if (c == '~' && n == 3)
+            eddelete(e, e->pos, e->pos + 1);
+    }
+}
+
+/*
+ * editline - Read a command line from the terminal, editing it in raw
+ *    mode. Like readcmdline, it returns buf ending in a newline, or
+ *    NULL on end of file. The terminal is back in its own mode before
+ *    the line is run.
+ */
+char *editline(const char *prompt, char *buf, int size) {
+    struct edit_t e = {buf, 0, 0, size, prompt, strlen(prompt)};
+    struct termios cooked, raw;
+    int c, done = 0;
+
+    pathindex();
+    fflush(stdout);
+    if (tcgetattr(STDIN_FILENO, &cooked) < 0)
+        unix_error("tcgetattr error");
+    raw = cooked;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    buf[0] = '\0';
+    edrefresh(&e);
+    while (!done) {
+        switch (c = edgetc()) {
+            case -1:                        /* end of file */
+                done = -1;
+                break;
+            case '\r':
+            case '\n':
+                done = 1;
+                break;
+            case 'A' - '@':
+                e.pos = 0;
+                break;
+            case 'E' - '@':
+                e.pos = e.len;
+                break;
+            case 'B' - '@':
+                if (e.pos > 0)
+                    e.pos--;
+                break;
+            case 'F' - '@':
+                if (e.pos < e.len)
+                    e.pos++;
+                break;
+            case 'D' - '@':
+                if (e.len == 0)
+                    done = -1;
+                eddelete(&e, e.pos, e.pos + 1);
+                break;
+            case '\b':
+            case 127:
+                eddelete(&e, e.pos - 1, e.pos);
+                break;
+            case 'K' - '@':
+                edkill(&e, e.pos, e.len);
+                break;
+            case 'U' - '@':
+                edkill(&e, 0, e.pos);
+                break;
+            case 'W' - '@':
+                edkill(&e, wordback(&e), e.pos);
+                break;
+            case 'Y' - '@':
+                edinsert(&e, killbuf, killlen);
+                break;
+            case 'L' - '@':
+                edwrite("\x1b[H\x1b[2J", 7);
+                break;
+            case 'C' - '@':                 /* start over on a new line */
+                edwrite("^C\n", 3);
+                e.len = e.pos = 0;
+                buf[0] = '\0';
+                break;
+            case '\t':
+                edcomplete(&e);
+                break;
+            case '\x1b':
+                edescape(&e);
+                break;
+            default:
+                if (c >= ' ') {
+                    char ch = c;
+                    edinsert(&e, &ch, 1);
+                }
+        }
+        if (done == 1)
+            e.pos = e.len;
+        edrefresh(&e);
+    }
+    edwrite("\n", 1);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+    if (done < 0)
+        return NULL;
+    buf[e.len++] = '\n';
+    buf[e.len] = '\0';
+    return buf;
+}
+/*************************************
+ * end line editor
+ *************************************/
+
+
+/***********************
+ * Other helper routines
+ ***********************/
+
+/*
+ * usage - print a help message and terminate
+ */
+void usage(void) {
+    printf("Usage: shell [-hvp]\n");
+    printf("   -h   print this message\n");
+    printf("   -v   print additional diagnostic information\n");
+    printf("   -p   do not emit a command prompt\n");
+    exit(1);
+}
+
+/*
+ * unix_error - unix-style error routine
+ */
+void unix_error(char *msg) {
+    fprintf(stdout, "%s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+/*
+ * app_error - application-style error routine
+ */
+void app_error(char *msg) {
+    fprintf(stdout, "%s\n", msg);
+    exit(1);
+}
+
+/*
+ * Malloc - wrapper for malloc that exits on failure
+ */
+void *Malloc(size_t size) {
+    void *p = malloc(size);
+
+    if (p == NULL)
+        unix_error("Malloc error");
+    return p;
+}
+
+/*
+ * Realloc - wrapper for realloc that exits on failure
+ */
+void *Realloc(void *ptr, size_t size) {
+    void *p = realloc(ptr, size);
+
+    if (p == NULL)
+        unix_error("Realloc error");
+    return p;
+}
+
+/*
+ * savestr - Malloc'd, NUL-terminated copy of s[0..len)
+ */
+char *savestr(const char *s, int len) {
+    char *p = Malloc(len + 1);
+
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
 }
 
 /*
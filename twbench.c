@@ -0,0 +1,59 @@
+/*
+ * twbench - Time arming and cancelling a deadline on the shell's timer
+ *    wheel with one and with 100k other deadlines pending, then run the
+ *    wheel through all of them and check each fires on its own ms.
+ *    Built from tsh.c itself, with the shell's main renamed.
+ */
+#define main tsh_main
+#include "tsh.c"
+#undef main
+
+#define PENDING 100000
+#define ROUNDS  1000000
+
+struct wtimer_t timers[PENDING + 1];
+long fired, late;
+
+void count(struct wtimer_t *t) {
+    fired++;
+    late += t->expires != wheel.now;
+}
+
+long long nsnow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* armcancel - ns per arm plus cancel of one more deadline */
+long long armcancel(void) {
+    struct wtimer_t *probe = &timers[PENDING];
+    long long start = nsnow();
+
+    for (long i = 0; i < ROUNDS; i++) {
+        twarm(probe, 1000 + (i * 7919) % 86400000);
+        twcancel(probe);
+    }
+    return (nsnow() - start) / ROUNDS;
+}
+
+int main(void) {
+    srandom(1);
+    for (int i = 0; i <= PENDING; i++)
+        timers[i].fire = count;
+
+    twarm(&timers[0], 1);
+    printf("bench04: arm+cancel with 1 pending: %lld ns\n", armcancel());
+
+    for (int i = 1; i < PENDING; i++)
+        twarm(&timers[i], 1 + random() % (7 * 86400000L)); /* up to a week */
+    printf("bench04: arm+cancel with %d pending: %lld ns\n", wheel.count, armcancel());
+
+    long long start = nsnow();
+    twrun(wheel.now + 7 * 86400000ULL + 1);
+    long long ns = nsnow() - start;
+    printf("bench04: ran a week of the wheel in %lld ms: %ld fired, %ld off time, %d left\n",
+           ns / 1000000, fired, late, wheel.count);
+    return late != 0 || fired != PENDING;
+}